@@ -54,17 +54,16 @@
 #include "ident.h"
 #include "imager.h"
 #include "gui.h"
+#include "read_ahead.h"
+#include "verify.h"
 #include <afflib/utils.h>		// get seglist
 #include <inttypes.h>
+#include <limits.h>
+#include <thread>
 
 #define xstr(s) str(s)
 #define str(s) #s
 
-/* global variables for imaging calculations */
-/* For autocompression */
-double ac_compress_write_time = 0;
-double ac_nocompress_write_time = 0;
-
 const char *progname = "aimage";
 
 int opt_zap = 0;
@@ -75,6 +74,7 @@ int opt_ident = 0;
 int   opt_compression_level = AF_COMPRESSION_DEFAULT;// default compression level
 int   opt_compression_alg   = AF_COMPRESSION_ALG_ZLIB;	// default algorithm
 int   opt_auto_compress = 0;
+int   opt_compress_threads = 0;		// compress pages on this many threads
 int   opt_make_config   = 0;
 aftimer total_time;			// total time spend imaging
 
@@ -83,6 +83,11 @@ aftimer total_time;			// total time spend imaging
 int  default_pagesize = 16*1024*1024;
 int  opt_pagesize    = default_pagesize;	// default seg size --- 16MB
 int  opt_readsectors = opt_pagesize / 512;      // read in 256K chunks
+int  opt_readsectors_auto = 0;			// pick the read size as we go
+int  opt_read_buffers = 4;			// buffers for the reader thread
+int  opt_io_uring = 0;				// io_uring queue depth; 0 for pread
+int  opt_direct = 0;				// read input with O_DIRECT
+const char *opt_mapfile = 0;			// ddrescue mapfile to write
 int64  opt_maxsize = (1<<31) - opt_pagesize;	
 int  maxsize_set = 0;
 
@@ -96,13 +101,22 @@ int  opt_quiet = 0;
 int  opt_silent = 0;
 int  opt_beeps  = 1;			// beep when done
 int  opt_recover_scan = 0;
+int64 opt_hash_window = 0;			// SHA256 each window of this many bytes
+int  opt_tree_hash = 0;				// and the tree over them
+int  opt_verify_readback = 0;			// and read each one back as we go
+int  opt_checkpoint = 60;			// seconds between checkpoints for --append
+int  opt_recover_order = RECOVER_FORWARD;
 int  opt_error_mode = 0;
 int  opt_retry_count = 5;
+int  opt_pass_time = 0;			// seconds per -e2 pass; 0 for no limit
+int  opt_slow_read = 0;			// ms; put off regions that read slower
+const char *opt_simulate_faults = 0;		// make the input fail like this
 int  opt_reverse = 0;
 int  opt_fast_quit = 0;
 int  opt_blink = 1;
 int  opt_hexbuf = AF_HEXBUF_SPACE4 | AF_HEXBUF_UPPERCASE;
 int  opt_verify = 0;
+int  opt_verify_hash = 0;		// verify against the stored hashes only
 int  opt_wipe = 0;
 
 char *opt_logfile_fname = 0;
@@ -152,6 +166,8 @@ void usage()
     printf("  A device (e.g. /dev/disk1)\n");
     printf("  - (or /dev/stdin, for standard input)\n");
     printf("  listen:nnnn       Listen on TCP port nnnn\n");
+    printf("  sim:size=n,...    A simulated drive, for testing (size, sector, latency,\n");
+    printf("                    seek, rate, data and faults; see input_source.h)\n");
 
     printf("OUTFILE may be:\n");
     printf("  outfile.aff --- image to the AFF file outfile\n");
@@ -162,6 +178,18 @@ void usage()
     printf("  --silent, -Q          -- No output at all except for errors.\n");
     printf("  --readsectors=nn, -R nnnn,   -- set number of sectors to read at once (default %d)\n",
 	   opt_readsectors);
+    printf("                           auto picks the fastest size up to %d, and re-checks\n",
+	   opt_readsectors);
+    printf("                           if the drive slows down.\n");
+    printf("  --read_buffers=n, -r n -- read ahead into n buffers in another thread (default %d)\n",
+	   opt_read_buffers);
+    printf("                           0 reads in the imaging thread.\n");
+    printf("  --io_uring=n, -U n    -- read with io_uring, keeping n %dK reads in flight\n",
+	   read_ahead::URING_PIECE_SIZE/1024);
+#ifndef HAVE_LIBURING
+    printf("                           (not available; compiled without liburing)\n");
+#endif
+    printf("  --direct, -O          -- read the input with O_DIRECT, bypassing the buffer cache\n");
     printf("  --version, -v         -- Just print the version number and exit.\n");
     printf("  --skip=nn[s], -k nn   -- Skip nn bytes [or nns for sectors] in input file\n");
     printf("  --no_beeps, -B        -- Don't beep when imaging is finished.\n");
@@ -170,12 +198,17 @@ void usage()
     printf("  --preview, -p         -- view some of the data as it goes by.\n");
     printf("  --no_preview, -P      -- do not show the preview.\n");
     printf("  --verify, -b        -- verify the input against the output file\n");
+    printf("  --verify_hash, -1   -- verify by hashing the input again, without reading\n");
+    printf("                         the output file (can't be used with --wipe)\n");
+    printf("  --verify_readback, -3 -- read the output file back and check it while\n");
+    printf("                         imaging (hashes each page unless --hash_window)\n");
     printf("  --wipe,     -w        -- verify after images and, if valid, wipe\n");
     printf("  --exec '',  -C''      -- run the command after imaging (before wiping) with %%s as image name\n");
 
     bold("\nExisting File Options:\n");
-    printf("  --append, -a          -- Append to existing file\n");
-    printf("   NOTE: --append is not yet implemented.\n");
+    printf("  --append, -a          -- Pick up where an interrupted image of this drive\n");
+    printf("                           left off, from its last checkpoint\n");
+    printf("  --checkpoint=n, -J n  -- Checkpoint every n seconds (default 60; 0 for never)\n");
     printf("  --zap, -z             -- Erase outfile(s) before writing\n");
 
     bold("\nAFF Options:\n");
@@ -200,7 +233,11 @@ void usage()
     printf("  --compression=n, -Xn  -- Set the compression level\n");
     printf("  --lzma_compress, -L   -- Use LZMA compression (slow but better)\n");
     printf("  --auto_compress, -A   -- write as fast as possible, with compression if it helps.\n");
-    printf("                           sets compression level 1\n");
+    printf("                           Each page is checked, and pages that look like they\n");
+    printf("                           won't compress are stored uncompressed.\n");
+    printf("                           sets compression level 2\n");
+    printf("  --compress_threads=n, -j n -- compress pages on n threads\n");
+    printf("                           (default 0: compress as each page is written)\n");
     printf("  --maxsize=n, -Mn      -- sets the maximum size of output file to be n..\n");
     printf("                           Default units are megabytes; \n");
     printf("                           suffix with 'g', 'm', 'k' or 'b'\n");
@@ -212,7 +249,13 @@ void usage()
     printf("                        -- Create segment 'name' and give it 'value'\n");
     printf("                           This option may be repeated.\n");
     printf("  --no_hash, -H         -- Do not calculate MD5, SHA1 and SHA256 of image.\n");
-    printf("  --multithreaded, -2   -- Calculate hashes in another thread\n");
+    printf("  --multithreaded, -2   -- Calculate MD5, SHA1 and SHA256 in parallel threads\n");
+    printf("  --hash_window=n, -n n -- Also store the SHA256 of every n bytes of the image,\n");
+    printf("                           so that parts of it can be checked; n may be 'page'\n");
+    printf("  --tree_hash, -N       -- Also store a tree hash over the windows (pages if\n");
+    printf("                           --hash_window is not given), which stays valid\n");
+    printf("                           however the image is read. With -2, the windows\n");
+    printf("                           are hashed on every core.\n");
 
 
     bold("\nError Recovery Options:\n");
@@ -221,11 +264,23 @@ void usage()
     printf("                     Then go to the end of the disk and read backwards\n");
     printf("                     until there are 5 erros in a row. Then stop.\n");
     printf("  --error=1  -e1  -- Stop reading at first error.\n");
+    printf("  --error=2  -e2  -- Recover a failing drive in passes, like ddrescue:\n");
+    printf("                     copy everything that reads easily, skipping ahead on errors;\n");
+    printf("                     copy what was skipped; trim the edges of the bad areas\n");
+    printf("                     a sector at a time; then try each remaining sector.\n");
+    printf("  --pass_time=n, -u n -- Give each -e2 pass at most n seconds (default no limit)\n");
+    printf("  --slow_read=ms, -W ms -- When a read takes longer than ms, skip ahead and read\n");
+    printf("                     the skipped region at the end (with -e2, in pass 2).\n");
+    printf("                     Out-of-order reading means no MD5/SHA1 of the image.\n");
     printf("  --retry=nn -tnn -- change retry count from 5 to nn\n");
     printf("  --reverse, -V   -- Scan in reverse to the beginning.\n");
+    printf("  --mapfile=fn, -f fn -- Write a ddrescue mapfile of the good, bad and unread regions.\n");
+    printf("                     (The same map is always stored in the AFF file.)\n");
     printf("  --recover-scan, -c   -- Starting with an AFF file that has been partially \n");
-    printf("                     acquired, try to read each page, 8 sectors at a time.\n");
+    printf("                     acquired, try to read each missing page.\n");
     printf("                     (implies --append)\n");
+    printf("  --recover_order=o, -K o -- read the missing pages forward (the default),\n");
+    printf("                     reverse or random\n");
 
     bold("\nOther:\n");
     printf("  --help, -h      -- Print this message.\n");
@@ -233,6 +288,9 @@ void usage()
     printf("  --allow_regular,   -E -- allow the imaging of a regular file\n");
     printf("  --title=s, -T s  -- change title to s (from IMAGING) and disable blink\n");
     printf("  --debug=n, -d n  -- set debug code n (-d0 for list)\n");
+    printf("  --simulate_faults=p, -F p -- make the input fail as if it were a bad drive.\n");
+    printf("                     p is a list of bad:S-E, slow:S-E@ms and flaky:S-E@pct,\n");
+    printf("                     in sectors; see bench_recovery.sh\n");
     printf("  --use_timers, -y -- Use timers for compressing, reading & writing times\n");
     printf("  --ident, -i      -- Just print the ident information and exit (for testing)\n");
 
@@ -255,6 +313,7 @@ void usage()
 int debug_list()
 {
     puts("-d99 - Make all reads in imager fail. For testing error routines.");
+    puts("-d98 - Make reads in the second quarter of the input slow. For testing --slow_read.");
     puts("-d2  - Print memcpy\n");
     exit(0);
 }
@@ -265,6 +324,9 @@ static struct option longopts[] = {
     { "quiet",         no_argument,        NULL, 'q'},
     { "silent",        no_argument,        NULL, 'Q'},
     { "readsectors",   required_argument,  NULL, 'R'},
+    { "read_buffers",  required_argument,  NULL, 'r'},
+    { "io_uring",      required_argument,  NULL, 'U'},
+    { "direct",        no_argument,        NULL, 'O'},
     { "image_pagesize",required_argument,  NULL, 'S'},
     { "zap",           no_argument,        NULL, 'z'},
     { "help",          no_argument,        NULL, 'h'},
@@ -275,6 +337,7 @@ static struct option longopts[] = {
     { "auto_compress", no_argument,        NULL, 'A'},
     { "no_beeps",      no_argument,        NULL, 'B'},
     { "append",        no_argument,        NULL, 'a'},
+    { "checkpoint",    required_argument,  NULL, 'J'},
     { "make_config",   no_argument,        NULL, 'm'},
     { "logfile",       required_argument,  NULL, 'l'},
     { "logAFF",        no_argument,	   NULL, 'G'},
@@ -296,12 +359,22 @@ static struct option longopts[] = {
     { "batch",         no_argument,        NULL, 'Y'},
     { "skip",          required_argument,  NULL, 'k'},
     { "recover-scan",  no_argument,        NULL, 'c'},
+    { "recover_order", required_argument,  NULL, 'K'},
     { "key-file",      required_argument,  NULL, 's'},
     { "verify",        no_argument,        NULL, 'b'},
+    { "verify_hash",   no_argument,        NULL, '1'},
+    { "verify_readback",no_argument,       NULL, '3'},
     { "wipe",          no_argument,        NULL, 'w'},
     { "exec",          required_argument,  NULL, 'C'},
     { "ident",         no_argument,        NULL, 'i'},
     { "multithreaded", no_argument,        NULL, '2'},
+    { "hash_window",   required_argument,  NULL, 'n'},
+    { "tree_hash",     no_argument,        NULL, 'N'},
+    { "compress_threads",required_argument,NULL, 'j'},
+    { "mapfile",       required_argument,  NULL, 'f'},
+    { "pass_time",     required_argument,  NULL, 'u'},
+    { "slow_read",     required_argument,  NULL, 'W'},
+    { "simulate_faults",required_argument, NULL, 'F'},
     {0,0,0,0}
 };
 
@@ -353,33 +426,6 @@ void segwrite_callback(struct affcallback_info *acbi)
 	im->callback_bytes_to_write += acbi->bytes_to_write;
 	im->callback_bytes_written  += acbi->bytes_written;
 	im->total_segments_written  ++;
-
-	if(opt_auto_compress){
-	    /* Handle automatic compression.
-	     */
-	    if(im->total_segments_written==1){
-		/* First segment was written.
-		 * Tabulate time and turn off compression.
-		 */
-		ac_compress_write_time += im->write_timer.lap_time();
-		af_enable_compression(acbi->af,AF_COMPRESSION_ALG_NONE,opt_compression_level);
-	    }
-	    if(im->total_segments_written==2){
-		/* Second segment was written.
-		 * Tabulate times and process.
-		 */
-		ac_nocompress_write_time += im->write_timer.lap_time();
-
-		/* Figure out which was faster */
-		if(ac_compress_write_time < ac_nocompress_write_time){
-		    /* Turn on compression */
-		    af_enable_compression(acbi->af, opt_compression_alg, opt_compression_level);
-		} else {
-		    /* Turn off compression */
-		    af_enable_compression(acbi->af, AF_COMPRESSION_ALG_NONE, opt_compression_level);
-		}
-	    }
-	}
     }
 
     /* Refresh if necessary */
@@ -433,6 +479,7 @@ void sig_intr(int arg)
 	AFFILE *af = current_imager->af;
 	printf("Closing output AFF file...\n\r");
 	fflush(stdout);
+	current_imager->write_map();	// record how far we got
 	af_set_callback(af,0);
 	af_enable_compression(af, 0, 0);
 	if(af_close(af)){
@@ -651,6 +698,18 @@ int64 scaled_atoi(const char *arg)
     return ret * multiplier;
 }
 
+/* A count for option --name, which must be a whole number, 0 or more */
+int count_atoi(const char *arg,const char *name)
+{
+    char *end = 0;
+    errno = 0;
+    long n = strtol(arg,&end,10);
+    if(errno || end==arg || *end || n<0 || n>INT_MAX){
+	errx(1,"--%s must be a number, 0 or more",name);
+    }
+    return (int)n;
+}
+
 
 
 /*
@@ -662,7 +721,19 @@ void process_option(class imager *im,char ch,char *optarg)
 {
     switch (ch) {
     case 'a': opt_append ++;	break;
+    case 'J': opt_checkpoint = count_atoi(optarg,"checkpoint"); break;
+    case 'n':
+	if(strcmp(optarg,"page")==0){
+	    opt_hash_window = -1;
+	    break;
+	}
+	opt_hash_window = scaled_atoi(optarg);
+	if(opt_hash_window<0) errx(1,"--hash_window must be page or a number of bytes");
+	break;
+    case 'N': opt_tree_hash = 1; break;
     case 'b': opt_verify++;   break;
+    case '1': opt_verify++;opt_verify_hash++; break;
+    case '3': opt_verify_readback = 1; break;
     case 'B': opt_beeps = 0;	break;
     case 'd': opt_debug = atoi(optarg); if(opt_debug==0) debug_list(); break;
     case 'D': opt_no_dmesg=1;	break;
@@ -673,9 +744,39 @@ void process_option(class imager *im,char ch,char *optarg)
     case 'o': strcpy(im->outfile,optarg);	break;
     case 'q': opt_quiet++;	break; 
     case 'Q': opt_silent++;	break;
-    case 'R': opt_readsectors = atoi(optarg); break;
+    case 'R':
+	if(strcmp(optarg,"auto")==0){
+	    opt_readsectors_auto = 1;
+	}
+	else {
+	    char *end = 0;
+	    errno = 0;
+	    long n = strtol(optarg,&end,10);
+	    if(errno || end==optarg || *end || n<=0 || n>INT_MAX){
+		errx(1,"--readsectors must be auto or a number of sectors");
+	    }
+	    opt_readsectors = n;
+	    opt_readsectors_auto = 0;
+	}
+	break;
+    case 'r':
+	opt_read_buffers = count_atoi(optarg,"read_buffers");
+	break;
+    case 'O': opt_direct = 1;		break;
+    case 'U':
+	opt_io_uring = count_atoi(optarg,"io_uring");
+#ifndef HAVE_LIBURING
+	warnx("compiled without liburing; --io_uring will read with pread");
+#endif
+	break;
     case 'z': opt_zap ++;	break;
     case 'c': opt_recover_scan++; opt_append++; break;
+    case 'K':
+	if(strcmp(optarg,"forward")==0) opt_recover_order = RECOVER_FORWARD;
+	else if(strcmp(optarg,"reverse")==0) opt_recover_order = RECOVER_REVERSE;
+	else if(strcmp(optarg,"random")==0) opt_recover_order = RECOVER_RANDOM;
+	else errx(1,"--recover_order must be forward, reverse or random");
+	break;
     case 'w': opt_verify++;opt_wipe++;	break;
     case 'k':
 	opt_skip  = atoi(optarg);
@@ -703,6 +804,11 @@ void process_option(class imager *im,char ch,char *optarg)
 	printf("aimage %s\n\n",PACKAGE_VERSION);
 	exit(0);
     case 'X': opt_compression_level = atoi(optarg); break;
+    case 'j': opt_compress_threads = count_atoi(optarg,"compress_threads"); break;
+    case 'f': opt_mapfile = optarg;	break;
+    case 'u': opt_pass_time = count_atoi(optarg,"pass_time"); break;
+    case 'W': opt_slow_read = count_atoi(optarg,"slow_read"); break;
+    case 'F': opt_simulate_faults = optarg; break;
     case 't': opt_retry_count = atoi(optarg); break;
     case 'm': opt_make_config = 1;	break;
     case 'V': opt_reverse = 1;		break;
@@ -794,48 +900,9 @@ void process_config_file_options()
 int verify_file(const char *file1,const char *file2)
 {
     setvbuf(stdout,0,_IONBF,0);
-    printf("Validating %s with %s\r\n",file1,file2);
-
-    AFFILE *af1 = af_open(file1,O_RDONLY,0777);
-    AFFILE *af2 = af_open(file2,O_RDONLY,0777);
-    unsigned char *buf1 = (unsigned char *)malloc(AFF_DEFAULT_PAGESIZE);
-    unsigned char *buf2 = (unsigned char *)malloc(AFF_DEFAULT_PAGESIZE);
-    if(!buf1 || !buf2) err(1,"malloc");
-    int64_t loc = 0;
-
-    /* We really want to do this page-by-page, rather than byte-by-byte, so that we can catch
-     * error recovered files...
-     */
-
-    while(!af_eof(af1)){
-	if(af_seek(af1,loc,SEEK_SET)<0) err(1,"af_seek(%s)",af_filename(af1));
-	if(af_seek(af2,loc,SEEK_SET)<0) err(1,"af_seek(%s)",af_filename(af2));
-	int bytes1 = af_read(af1,buf1,AFF_DEFAULT_PAGESIZE);
-	if(bytes1==0) break;		// nothing more to read
-	int bytes2 = af_read(af2,buf2,bytes1);
-	printf("Verifying %d bytes at %" PRId64 " ...", bytes1, loc);
-	if(bytes1!=bytes2){
-	    fprintf(stderr,"Read different amounts of bytes from file1 (%d) and file2 (%d)",bytes1,bytes2);
-	    free(buf1);
-	    free(buf2);
-	    return -1;
-	}
-	if(memcmp(buf1,buf2,bytes1)!=0){
-	    fprintf(stderr,"Read different values from file1 and file2\r\n");
-	    fprintf(stderr,"bytes1=%d  bytes2=%d\r\n",bytes1,bytes2);
-	    free(buf1);
-	    free(buf2);
-	    return -2;
-	}
-	loc += bytes1;
-	printf("\r\n");
-    }
-    af_close(af1);
-    af_close(af2);
-    free(buf1);
-    free(buf2);
-    printf("%s verifys\r\n",file2);
-    return 0;
+    int nthreads = std::thread::hardware_concurrency();
+    verifier v(file1,file2,nthreads>0 ? nthreads : 1);
+    return opt_verify_hash ? v.run_hashes() : v.run();
 }
 
 int wipe(const char *file1)
@@ -930,6 +997,13 @@ int main(int argc,char **argv)
     argc -= optind;
     argv += optind;
 
+    /* --verify_hash never reads the image, so it can't show that the
+     * image is good enough to wipe the drive it came from.
+     */
+    if(opt_wipe && opt_verify_hash){
+	errx(1,"--wipe needs --verify; --verify_hash does not read the image");
+    }
+
     if(default_pagesize != opt_pagesize && !maxsize_set){
 	opt_maxsize = (1<<31) - opt_pagesize; // recalculate maxsize
     }
@@ -1089,7 +1163,9 @@ int main(int argc,char **argv)
 
 	beeps(1);			// one beep to start
 	gui_startup();
+	current_imager = im;	// so that ^c can close it and save the map
 	im->start_imaging();	// run aimage
+	current_imager = 0;
 	gui_shutdown();
 
 	/* AFF cleanup */
@@ -1105,6 +1181,13 @@ int main(int argc,char **argv)
 	}
 	im->af = 0;
 
+	/* Finish reading it back */
+	if(im->rb && im->rb->finish()){
+	    for(int i=0;i<20;i++){
+		printf("\r\n");
+	    }
+	    errx(1,"read-back verify failed\n");
+	}
 
 	/* Now verify the file */
 	if(im->infile[0] && opt_verify){
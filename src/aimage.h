@@ -69,6 +69,15 @@
 #include <afflib/afflib_i.h>			
 #include <afflib/aftimer.h>
 
+/* Segments that aimage writes besides the AFFLIB ones */
+#define AIMAGE_AUTOCOMPRESS_COMPRESSED "aimage_autocompress_compressed" // pages -A compressed
+#define AIMAGE_AUTOCOMPRESS_STORED     "aimage_autocompress_stored"     // pages -A did not
+#define AIMAGE_SECTOR_MAP              "aimage_sector_map" // see sector_map.h; arg is sector size
+#define AIMAGE_CHECKPOINT              "aimage_checkpoint" // where to pick up with --append
+#define AIMAGE_HASH_WINDOW             "aimage_hash_window" // bytes in each window; see window_hash.h
+#define AIMAGE_WINDOW_SHA256           "aimage_window%" I64d "_sha256" // SHA256 of window n
+#define AIMAGE_TREE_SHA256             "aimage_tree_sha256" // root over the windows
+
 #define AIMAGE_CONFIG "AIMAGE_CONFIG"
 #define AIMAGE_CONFIG_FILENAME "aimage.cfg"
 
@@ -93,8 +102,13 @@ extern int opt_pagesize;
 extern int opt_compression_level;
 extern int opt_compression_alg;
 extern int opt_auto_compress;
+extern int opt_compress_threads;
+extern const char *opt_sign_key_file;
 extern int opt_error_mode;
 extern int opt_retry_count;
+extern int opt_pass_time;
+extern int opt_slow_read;
+extern const char *opt_simulate_faults;	// see fault_profile.h
 extern int opt_quiet;			// 1 if no curses gui
 extern int opt_batch;			// output status in batch form
 extern int opt_silent;
@@ -104,6 +118,11 @@ extern int opt_skip_sectors;
 extern int opt_reverse;
 extern int opt_beeps;
 extern int opt_readsectors;
+extern int opt_readsectors_auto;
+extern int opt_read_buffers;
+extern int opt_io_uring;
+extern int opt_direct;
+extern const char *opt_mapfile;
 extern int opt_hexbuf;
 extern int opt_use_timers;
 extern int64 opt_maxsize;
@@ -111,7 +130,15 @@ extern char *command_line;
 extern int opt_no_dmesg;
 extern int opt_no_ifconfig;
 extern int opt_append;
+extern int64 opt_hash_window;		// bytes; -1 for the page size; 0 for none
+extern int opt_tree_hash;		// store the tree hash over the windows
+extern int opt_verify_readback;		// read each window back while imaging
+extern int opt_checkpoint;		// seconds between checkpoints; 0 for none
 extern int opt_recover_scan;
+extern int opt_recover_order;		// RECOVER_FORWARD, RECOVER_REVERSE or RECOVER_RANDOM
+#define RECOVER_FORWARD 0
+#define RECOVER_REVERSE 1
+#define RECOVER_RANDOM  2
 
 /* Current imager */
 using namespace std;
@@ -0,0 +1,75 @@
+/*
+ * auto_compress.cpp:
+ * Per-page compression decisions for aimage -A.
+ */
+
+#include "config.h"
+#include "auto_compress.h"
+
+#include <string.h>
+#include <math.h>
+
+const double auto_compress::ENTROPY_THRESHOLD = 7.5;
+
+auto_compress::auto_compress():pages_compressed(0),pages_stored(0)
+{
+    memset(hist,0,sizeof(hist));
+}
+
+/* Add a SAMPLE_SIZE slice from every SAMPLE_STRIDE bytes of buf to hist */
+void auto_compress::sample(const unsigned char *buf,size_t len,uint64_t h[256])
+{
+    for(size_t off=0;off<len;off+=SAMPLE_STRIDE){
+	size_t n = len-off < SAMPLE_SIZE ? len-off : SAMPLE_SIZE;
+	const unsigned char *p = buf+off;
+	for(size_t i=0;i<n;i++){
+	    h[p[i]]++;
+	}
+    }
+}
+
+double auto_compress::entropy(const uint64_t h[256])
+{
+    uint64_t total = 0;
+    for(int i=0;i<256;i++) total += h[i];
+    if(total==0) return 0;
+
+    double e = 0;
+    for(int i=0;i<256;i++){
+	if(h[i]==0) continue;
+	double p = (double)h[i] / total;
+	e -= p * log2(p);
+    }
+    return e;
+}
+
+bool auto_compress::record(bool compress)
+{
+    if(compress) pages_compressed++;
+    else pages_stored++;
+    return compress;
+}
+
+void auto_compress::add(const unsigned char *buf,size_t len)
+{
+    sample(buf,len,hist);
+}
+
+bool auto_compress::decide()
+{
+    uint64_t total = 0;
+    for(int i=0;i<256;i++) total += hist[i];
+    if(total==0) return true;		// nothing sampled since the last page
+
+    bool compress = entropy(hist) < ENTROPY_THRESHOLD;
+    memset(hist,0,sizeof(hist));
+    return record(compress);
+}
+
+bool auto_compress::compressible(const unsigned char *buf,size_t len)
+{
+    uint64_t h[256];
+    memset(h,0,sizeof(h));
+    sample(buf,len,h);
+    return record(entropy(h) < ENTROPY_THRESHOLD);
+}
@@ -0,0 +1,54 @@
+/*
+ * auto_compress.h:
+ * Decide, page by page, whether compressing is worth it (-A).
+ *
+ * A drive mixes regions that compress well (empty space, text,
+ * programs) with regions that don't (encrypted volumes, media files),
+ * so one decision for the whole drive is usually wrong somewhere.
+ * Instead, every page gets a cheap estimate of how compressible it is:
+ * the byte entropy of a SAMPLE_SIZE slice taken every SAMPLE_STRIDE
+ * bytes. Pages whose estimate is below ENTROPY_THRESHOLD bits per
+ * byte are compressed; the rest are stored as they are, which saves
+ * the time that would have been spent failing to compress them.
+ *
+ * The serial path in write_data() may see a page in several pieces, so
+ * the samples are added to a histogram with add() and the decision is
+ * made with decide() when the page is complete. The compression threads
+ * see whole pages and call compressible(). Every decision is counted;
+ * a page that the compression threads hand to af_write() in pieces
+ * (around a bad region) counts once per piece.
+ */
+
+#ifndef AUTO_COMPRESS_H
+#define AUTO_COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+class auto_compress {
+public:
+    static const double ENTROPY_THRESHOLD;	// bits per byte
+    static const size_t SAMPLE_SIZE   = 512;
+    static const size_t SAMPLE_STRIDE = 256*1024;
+
+    auto_compress();
+
+    void add(const unsigned char *buf,size_t len); // sample part of the current page
+    bool decide();			// should the current page be compressed?
+    bool compressible(const unsigned char *buf,size_t len); // for a whole page
+
+    uint64_t compressed() const { return pages_compressed; }
+    uint64_t stored() const { return pages_stored; }
+
+private:
+    static void sample(const unsigned char *buf,size_t len,uint64_t hist[256]);
+    static double entropy(const uint64_t hist[256]);
+    bool record(bool compress);
+
+    uint64_t hist[256];			// samples of the current page
+    std::atomic<uint64_t> pages_compressed;
+    std::atomic<uint64_t> pages_stored;
+};
+
+#endif
@@ -0,0 +1,61 @@
+#!/bin/sh
+#
+# bench.sh:
+# Time aimage end to end on simulated drives full of each kind of data
+# (see input_source.h), over a range of read sizes, page sizes and
+# compression settings, and print CSV: the throughput, the CPU time,
+# and the size of the AFF file as a fraction of the input.
+# Run by "make bench".
+#
+# usage: bench.sh [aimage [megabytes]]
+# Set CORPORA, READSECTORS, PAGESIZES, COMPRESSION (settings separated
+# by |) or OPTIONS in the environment to change what is run.
+#
+
+AIMAGE=${1:-./aimage}
+MB=${2:-64}
+CORPORA=${CORPORA:-"zero random text mixed"}
+READSECTORS=${READSECTORS:-"128 2048 32768"}
+PAGESIZES=${PAGESIZES:-"1m 16m"}
+COMPRESSION=${COMPRESSION:-"-x|-X1|-X6|-X9|-L"}
+DIR=${TMPDIR:-/tmp}/bench.$$
+mkdir -p $DIR || exit 1
+trap 'rm -rf $DIR' 0 1 2 15
+
+BYTES=`expr $MB \* 1048576`
+
+# The user+system time of the programs this shell has run, from times.
+# times must not run in a subshell, so it is written to a file.
+cpu_seconds() {
+    awk 'NR==2 {
+	s = 0
+	for(i=1;i<=2;i++){ split($i,t,"m"); sub("s","",t[2]); s += t[1]*60 + t[2] }
+	printf "%.3f", s
+    }' $1
+}
+
+echo "corpus,readsectors,pagesize,compression,seconds,mb_per_second,cpu_seconds,output_ratio"
+for corpus in $CORPORA ; do
+    for readsectors in $READSECTORS ; do
+	for pagesize in $PAGESIZES ; do
+	    IFS='|'
+	    for compression in $COMPRESSION ; do
+		IFS=' '
+		times > $DIR/times0
+		start=`date +%s.%N`
+		$AIMAGE -q -Q -D -I -z -R$readsectors -S$pagesize $compression $OPTIONS \
+		    "sim:size=${MB}M,data=$corpus" $DIR/out.aff >/dev/null 2>&1
+		end=`date +%s.%N`
+		times > $DIR/times1
+		out=`wc -c < $DIR/out.aff`
+		echo $corpus $readsectors $pagesize "$compression" $start $end \
+		    `cpu_seconds $DIR/times0` `cpu_seconds $DIR/times1` $out $BYTES |
+		awk '{ secs = $6-$5;
+		       printf "%s,%s,%s,%s,%.2f,%.1f,%.2f,%.4f\n", $1,$2,$3,$4,
+			      secs, $10/1048576/secs, $8-$7, $9/$10 }'
+		IFS='|'
+	    done
+	    IFS=' '
+	done
+    done
+done
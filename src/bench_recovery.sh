@@ -0,0 +1,67 @@
+#!/bin/sh
+#
+# bench_recovery.sh:
+# Image a simulated drive that fails in various ways with each of
+# several error recovery strategies, and report how long each took,
+# how many sectors it got and how many bytes it lost, as CSV.
+# Run by "make bench-recovery".
+#
+# usage: bench_recovery.sh [aimage [megabytes]]
+#
+
+AIMAGE=${1:-./aimage}
+MB=${2:-64}
+DIR=${TMPDIR:-/tmp}/bench_recovery.$$
+mkdir -p $DIR || exit 1
+trap 'rm -rf $DIR' 0 1 2 15
+
+SECTORS=`expr $MB \* 2048`
+BYTES=`expr $MB \* 1048576`
+
+# The failure profiles (see fault_profile.h), in sectors:
+#  scattered:    one bad sector every 9973
+#  dead_band:    1% of the drive, in the middle, unreadable
+#  slow:         10% of the drive reads, but 20ms a read
+#  intermittent: reads of 10% of the drive fail one time in ten
+scattered=""
+s=997
+while [ $s -lt $SECTORS ]; do
+    scattered="$scattered${scattered:+,}bad:$s"
+    s=`expr $s + 9973`
+done
+band=`expr $SECTORS / 2`
+dead_band="bad:$band-`expr $band + $SECTORS / 100`"
+slow_start=`expr $SECTORS / 4`
+slow="slow:$slow_start-`expr $slow_start + $SECTORS / 10`@20"
+flaky_start=`expr $SECTORS / 4 \* 3`
+intermittent="flaky:$flaky_start-`expr $flaky_start + $SECTORS / 10`@10"
+
+# The strategies: aimage options, separated by |
+STRATEGIES="-e0|-e0 -t1|-e0 -R64|-e1|-e2|-e2 -R64|-e0 -W10|-e2 -W10"
+
+echo "profile,strategy,seconds,sectors_recovered,bytes_lost"
+for profile in scattered dead_band slow intermittent ; do
+    eval faults=\$$profile
+    IFS='|'
+    for strategy in $STRATEGIES ; do
+	IFS=' '
+	rm -f $DIR/out.aff $DIR/map
+	start=`date +%s.%N`
+	$AIMAGE -x -q -Q -D -I -z $strategy --mapfile=$DIR/map \
+	    "sim:size=${MB}M,data=random,faults=$faults" $DIR/out.aff >/dev/null 2>&1
+	end=`date +%s.%N`
+
+	# Add up the finished extents of the mapfile; its first line
+	# that isn't a comment is the current position.
+	good=0
+	first=1
+	while read pos size status ; do
+	    case "$pos" in \#*|"") continue ;; esac
+	    if [ $first = 1 ] ; then first=0 ; continue ; fi
+	    if [ "$status" = "+" ] ; then good=$((good + size)) ; fi
+	done < $DIR/map
+	echo "$profile,$strategy,`echo $start $end | awk '{printf "%.2f", $2-$1}'`,`expr $good / 512`,`expr $BYTES - $good`"
+	IFS='|'
+    done
+    IFS=' '
+done
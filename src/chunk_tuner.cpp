@@ -0,0 +1,83 @@
+/*
+ * chunk_tuner.cpp:
+ * Adaptive read sizing for image_loop.
+ */
+
+#include "config.h"
+#include "chunk_tuner.h"
+
+const double chunk_tuner::REPROBE_FRACTION = 0.5;
+
+chunk_tuner::chunk_tuner(int max_sectors,int sector_size_):
+    state(PROBING),sector_size(sector_size_),candidates(),rates(),current(0),nprobes(0),
+    bytes(0),seconds(0),settled_rate(0)
+{
+    if(sector_size<=0) sector_size = 512;
+    int min_sectors = MIN_CHUNK / sector_size;
+    if(min_sectors<1) min_sectors = 1;
+    for(int s=min_sectors; s<max_sectors; s*=2){
+	candidates.push_back(s);
+    }
+    if(max_sectors>0) candidates.push_back(max_sectors); // the largest is always a candidate
+    if(candidates.empty()) candidates.push_back(min_sectors);
+    rates.resize(candidates.size());
+    begin_probe();
+}
+
+int chunk_tuner::sectors() const
+{
+    return candidates[current];
+}
+
+void chunk_tuner::begin_probe()
+{
+    state   = PROBING;
+    current = 0;
+    bytes   = 0;
+    seconds = 0;
+    nprobes++;
+    if(candidates.size()==1) settle();	// nothing to choose from
+}
+
+/* Pick the candidate with the best throughput. */
+void chunk_tuner::settle()
+{
+    size_t best = 0;
+    for(size_t i=1;i<rates.size();i++){
+	if(rates[i] > rates[best]) best = i;
+    }
+    state        = SETTLED;
+    current      = best;
+    settled_rate = rates[best];
+    bytes   = 0;
+    seconds = 0;
+}
+
+void chunk_tuner::record(int nbytes,double nseconds)
+{
+    if(nbytes<=0) return;
+    bytes   += nbytes;
+    seconds += nseconds;
+
+    if(state==PROBING){
+	uint64_t enough = PROBE_BYTES;
+	if(enough < (uint64_t)PROBE_READS * candidates[current] * sector_size){
+	    enough = (uint64_t)PROBE_READS * candidates[current] * sector_size;
+	}
+	if(bytes < enough) return;
+	rates[current] = seconds>0 ? bytes / seconds : 0;
+	bytes   = 0;
+	seconds = 0;
+	if(++current == candidates.size()) settle();
+	return;
+    }
+
+    /* Settled; see if the drive has slowed down */
+    if(bytes < WINDOW_BYTES) return;
+    double rate = seconds>0 ? bytes / seconds : 0;
+    bytes   = 0;
+    seconds = 0;
+    if(settled_rate>0 && rate < settled_rate * REPROBE_FRACTION){
+	begin_probe();
+    }
+}
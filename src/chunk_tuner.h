@@ -0,0 +1,56 @@
+/*
+ * chunk_tuner.h:
+ * Pick the number of sectors image_loop reads at a time (-R auto).
+ *
+ * Bridges and drives differ a great deal in the read size they like
+ * best. The tuner starts by probing: it tries each power-of-two read
+ * size from MIN_CHUNK bytes up to the largest size allowed, for
+ * PROBE_BYTES of input apiece, and records the throughput of each.
+ * It then settles on the fastest. While settled, it keeps measuring
+ * over windows of WINDOW_BYTES; if a window's throughput falls below
+ * REPROBE_FRACTION of what the probe measured, it probes again.
+ *
+ * image_loop calls sectors() before every read and record() after
+ * every complete forward read, with the time the read itself took.
+ */
+
+#ifndef CHUNK_TUNER_H
+#define CHUNK_TUNER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+class chunk_tuner {
+public:
+    static const int      MIN_CHUNK   = 64*1024;
+    static const uint64_t PROBE_BYTES = 32*1024*1024;
+    static const int      PROBE_READS = 4;	// fewest reads per probe
+    static const uint64_t WINDOW_BYTES = 256*1024*1024;
+    static const double   REPROBE_FRACTION;
+
+    chunk_tuner(int max_sectors,int sector_size);
+
+    int  sectors() const;		// read this many sectors next
+    void record(int bytes,double seconds); // a read of the current size finished
+    bool probing() const { return state==PROBING; }
+    int  probes() const { return nprobes; }	// how many times we have probed
+    double best_rate() const { return settled_rate; } // bytes/sec, when settled
+
+private:
+    enum { PROBING, SETTLED } state;
+    void begin_probe();
+    void settle();
+
+    int sector_size;
+    std::vector<int> candidates;	// read sizes to try, in sectors
+    std::vector<double> rates;		// bytes/sec measured for each
+    size_t current;			// index into candidates
+    int nprobes;
+
+    uint64_t bytes;			// measured so far for this probe or window
+    double   seconds;
+    double   settled_rate;		// what the chosen size did while probing
+};
+
+#endif
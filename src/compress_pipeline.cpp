@@ -0,0 +1,312 @@
+/*
+ * compress_pipeline.cpp:
+ * Page compression on worker threads for imager::write_data().
+ */
+
+#include "config.h"
+#include "compress_pipeline.h"
+#include "auto_compress.h"
+#include "zero_detect.h"
+
+#include <afflib/afflib_i.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+
+/* The pipeline bypasses af_write(), so it can only be used when
+ * af_write() would just have handed full pages to af_update_page():
+ * not when the vnode does its own writing (raw output), and not when
+ * we can't compress the way afflib does.
+ */
+bool compress_pipeline::usable(AFFILE *af)
+{
+    if(af==0 || af->image_pagesize==0) return false;
+    if(af->v && af->v->write) return false;
+#ifndef HAVE_LZMA_COMPRESS
+    if(af->compression_type==AF_COMPRESSION_ALG_LZMA) return false;
+#endif
+    return true;
+}
+
+compress_pipeline::compress_pipeline(AFFILE *af_,int nthreads,class auto_compress *ac_):
+    af(af_),ac(ac_),comp_type(af_->compression_type),comp_level(af_->compression_level),
+    pagesize(af_->image_pagesize),max_pending(0),
+    page(0),fill(0),next_pos(af_tell(af_)),af_dirty(false),
+    M(),work_ready(),job_done(),queue(),pending(),freelist(),finished(false),threads()
+{
+    if(nthreads<1) nthreads = 1;
+    max_pending = nthreads * 2;		// keeps every thread busy while we write
+    for(int i=0;i<nthreads;i++){
+	threads.push_back(std::thread(&compress_pipeline::run,this));
+    }
+}
+
+compress_pipeline::~compress_pipeline()
+{
+    flush();
+    {
+	std::lock_guard<std::mutex> lock(M);
+	finished = true;
+	work_ready.notify_all();
+    }
+    for(size_t i=0;i<threads.size();i++){
+	threads[i].join();
+    }
+    delete page;
+    for(size_t i=0;i<freelist.size();i++){
+	delete freelist[i];
+    }
+}
+
+void compress_pipeline::write(const unsigned char *buf,uint64_t offset,int len)
+{
+    while(len>0){
+	/* A partial page that this doesn't continue goes to af_write */
+	if(fill>0 && offset!=next_pos) spill();
+
+	uint32_t page_offset = offset % pagesize;
+	uint32_t n = pagesize - page_offset;
+	if((uint32_t)len < n) n = len;
+
+	if(fill==0 && page_offset!=0){
+	    /* Not the start of a page; let af_write deal with it */
+	    write_done(true);
+	    write_af(buf,offset,n);
+	}
+	else {
+	    if(fill==0){
+		/* Starting a new page. Anything af_write left behind
+		 * would have been written before this page; do that now.
+		 */
+		if(af_dirty){
+		    af_cache_flush(af);
+		    af_dirty = false;
+		}
+		{
+		    std::lock_guard<std::mutex> lock(M);
+		    if(freelist.size()){
+			page = freelist.back();
+			freelist.pop_back();
+		    }
+		}
+		if(!page) page = new job();
+		page->pagenum = offset / pagesize;
+		page->data.resize(pagesize);
+	    }
+	    memcpy(&page->data[fill],buf,n);
+	    fill += n;
+	    if(fill==pagesize) submit();
+	}
+	buf      += n;
+	offset   += n;
+	len      -= n;
+	next_pos  = offset;
+    }
+    write_done(false);			// write whatever is ready
+}
+
+/* page is full. Queue it for the workers, waiting if too many are pending. */
+void compress_pipeline::submit()
+{
+    if(ac){
+	page->comp_type  = comp_type;	// ac decides in compress()
+	page->comp_level = comp_level;
+    }
+    else {
+	page->comp_type  = af->compression_type; // in case the callback changed them
+	page->comp_level = af->compression_level;
+    }
+    page->done       = false;
+    while(true){
+	{
+	    std::lock_guard<std::mutex> lock(M);
+	    if(pending.size() < max_pending) break;
+	}
+	write_next(true);
+    }
+    {
+	std::lock_guard<std::mutex> lock(M);
+	pending.push_back(page);
+	queue.push_back(page);
+	work_ready.notify_one();
+    }
+    page = 0;
+    fill = 0;
+}
+
+/* Write the oldest pending page if it has been compressed, or
+ * after waiting for it if wait is set. Returns false if nothing was written.
+ */
+bool compress_pipeline::write_next(bool wait)
+{
+    job *j = 0;
+    {
+	std::unique_lock<std::mutex> lock(M);
+	if(pending.empty()) return false;
+	if(wait) job_done.wait(lock,[this]{ return pending.front()->done; });
+	if(!pending.front()->done) return false;
+	j = pending.front();
+	pending.pop_front();
+    }
+    write_page(j);
+    std::lock_guard<std::mutex> lock(M);
+    freelist.push_back(j);
+    return true;
+}
+
+/* Write the compressed pages at the front of pending; all waits for every one. */
+void compress_pipeline::write_done(bool all)
+{
+    while(write_next(all)){
+    }
+}
+
+/* What af_update_page() and af_write() do once the page is compressed */
+void compress_pipeline::write_page(job *j)
+{
+    char segname[32];
+    snprintf(segname,sizeof(segname),AF_PAGE,j->pagenum);
+
+    struct affcallback_info acbi;
+    memset(&acbi,0,sizeof(acbi));
+    acbi.info_version      = 1;
+    acbi.af                = af->parent ? af->parent : af;
+    acbi.pagenum           = j->pagenum;
+    acbi.bytes_to_write    = j->data.size();
+    acbi.compression_alg   = j->alg;
+    acbi.compression_level = j->level;
+    acbi.compressed        = j->compressed;
+
+    if(af->w_callback) {acbi.phase = 3;(*af->w_callback)(&acbi);}
+    int ret;
+    if(j->outlen){
+	ret = af_update_segf(af,segname,j->flag,&j->out[0],j->outlen,1);
+	acbi.bytes_written = j->outlen;
+    }
+    else {
+	ret = af_update_segf(af,segname,0,&j->data[0],j->data.size(),1);
+	acbi.bytes_written = j->data.size();
+    }
+    if(af->w_callback) {acbi.phase = 4;(*af->w_callback)(&acbi);}
+    if(ret!=0) err(1,"af_update_segf(%s)",segname);
+
+    af->pages_written++;
+    if(j->outlen) af->pages_compressed++;
+
+    uint64_t end = (uint64_t)j->pagenum * pagesize + j->data.size();
+    af->pos = end;
+    af->bytes_written += j->data.size();
+    if((int64_t)end > af->image_size) af->image_size = end;
+}
+
+/* Hand part of a page to af_write. With -A, the last decision made
+ * for a page is the one afflib uses when it writes the page out.
+ */
+void compress_pipeline::write_af(const unsigned char *buf,uint64_t offset,uint32_t n)
+{
+    if(ac){
+	af_enable_compression(af,ac->compressible(buf,n) ? comp_type : AF_COMPRESSION_ALG_NONE,
+			      comp_level);
+    }
+    af_seek(af,offset,SEEK_SET);
+    if(af_write(af,(unsigned char *)buf,n)!=(int)n){
+	err(1,"af_write");
+    }
+    af_dirty = true;
+}
+
+/* Write everything pending, then give the partial page to af_write */
+void compress_pipeline::spill()
+{
+    write_done(true);
+    if(fill>0){
+	write_af(&page->data[0],(uint64_t)page->pagenum * pagesize,fill);
+	std::lock_guard<std::mutex> lock(M);
+	freelist.push_back(page);
+	page = 0;
+	fill = 0;
+    }
+}
+
+void compress_pipeline::flush()
+{
+    spill();
+}
+
+/* Compress the page the way af_update_page() does. */
+void compress_pipeline::compress(job *j)
+{
+    j->outlen     = 0;
+    j->flag       = 0;
+    j->alg        = 0;
+    j->level      = 0;
+    j->compressed = false;
+    if(j->comp_type==AF_COMPRESSION_ALG_NONE) return;
+    if(ac && !ac->compressible(&j->data[0],j->data.size())) return;
+
+    size_t datalen = j->data.size();
+    j->out.resize(pagesize);
+    size_t destLen = pagesize;
+    int cres = -1;
+
+    /* Zero pages are stored as just their length */
+    if(buffer_is_zero(&j->data[0],datalen)){
+	j->alg        = AF_PAGE_COMP_ALG_ZERO;
+	j->level      = AF_COMPRESSION_MAX;
+	j->compressed = true;
+	uint32_t len_n = htonl(datalen);
+	memcpy(&j->out[0],&len_n,4);
+	j->outlen = 4;
+	j->flag   = AF_PAGE_COMPRESSED | AF_PAGE_COMP_ALG_ZERO | AF_PAGE_COMP_MAX;
+	return;
+    }
+
+#ifdef HAVE_LZMA_COMPRESS
+    if(j->comp_type==AF_COMPRESSION_ALG_LZMA){
+	j->alg        = AF_PAGE_COMP_ALG_LZMA;
+	j->level      = 7;
+	j->compressed = true;
+	cres = lzma_compress(&j->out[0],&destLen,&j->data[0],datalen,9);
+	if(cres==0 && destLen < pagesize){ // as afflib: only if it saves space
+	    j->outlen = destLen;
+	    j->flag   = AF_PAGE_COMPRESSED | AF_PAGE_COMP_ALG_LZMA;
+	}
+	return;				// afflib doesn't try zlib if LZMA fails
+    }
+#endif
+
+    if(j->comp_type==AF_COMPRESSION_ALG_ZLIB){
+	j->alg        = AF_PAGE_COMP_ALG_ZLIB;
+	j->level      = j->comp_level;
+	j->compressed = true;
+	uLongf zlen = destLen;
+	cres = compress2((Bytef *)&j->out[0],&zlen,(Bytef *)&j->data[0],datalen,j->comp_level);
+	if(cres==Z_OK && zlen < pagesize){ // as afflib: only if it saves space
+	    j->outlen = zlen;
+	    j->flag   = AF_PAGE_COMPRESSED | AF_PAGE_COMP_ALG_ZLIB;
+	    if(j->comp_level==AF_COMPRESSION_MAX) j->flag |= AF_PAGE_COMP_MAX;
+	}
+    }
+}
+
+void compress_pipeline::run()
+{
+    while(true){
+	job *j = 0;
+	{
+	    std::unique_lock<std::mutex> lock(M);
+	    work_ready.wait(lock,[this]{ return queue.size()>0 || finished; });
+	    if(queue.empty()) return;
+	    j = queue.front();
+	    queue.pop_front();
+	}
+	compress(j);
+	std::lock_guard<std::mutex> lock(M);
+	j->done = true;
+	job_done.notify_all();
+    }
+}
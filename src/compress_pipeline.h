@@ -0,0 +1,100 @@
+/*
+ * compress_pipeline.h:
+ * Compress AFF pages on a pool of threads.
+ *
+ * Without this, afflib compresses each page inside af_write(), on the
+ * imaging thread, and with -X9 or -L that is most of the run time.
+ * The pipeline collects what write_data() is given into full pages,
+ * hands each page to one of nthreads worker threads, and writes the
+ * compressed pages with af_update_segf() in page order, on the
+ * imaging thread, so that afflib and the segwrite callback are only
+ * ever called from one thread. The workers compress each page exactly
+ * the way af_update_page() does, so the AFF file is the same as the
+ * one af_write() would have made.
+ *
+ * Only whole pages written in order go through the pipeline. Anything
+ * else (the partial page at the end of the drive, or the writes around
+ * a bad region that was skipped) waits for the pending pages to be
+ * written and then goes through af_write() as usual.
+ *
+ * With -A, ac decides for each page whether it is compressed at all.
+ *
+ * The offset is always where buf goes in the image.
+ * flush() must be called before the AFFILE is closed.
+ */
+
+#ifndef COMPRESS_PIPELINE_H
+#define COMPRESS_PIPELINE_H
+
+#include <stdint.h>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include <afflib/afflib.h>
+
+class compress_pipeline {
+public:
+    static bool usable(AFFILE *af);	// can af be written this way?
+
+    compress_pipeline(AFFILE *af,int nthreads,class auto_compress *ac=0);
+    ~compress_pipeline();
+
+    void write(const unsigned char *buf,uint64_t offset,int len); // instead of af_seek/af_write
+    void flush();			// write everything that is pending
+
+private:
+    compress_pipeline(const compress_pipeline &);		// not implemented
+    compress_pipeline &operator=(const compress_pipeline &);	// not implemented
+
+    class job {				// one page
+    public:
+	job():pagenum(0),data(),comp_type(0),comp_level(0),out(),outlen(0),flag(0),
+	      alg(0),level(0),compressed(false),done(false){}
+	int64_t pagenum;
+	std::vector<unsigned char> data;
+	int comp_type;			// af's compression settings when submitted
+	int comp_level;
+	std::vector<unsigned char> out;	// what to write
+	size_t   outlen;		// 0 means write data uncompressed
+	uint32_t flag;			// segment flag
+	int  alg;			// for the callback
+	int  level;
+	bool compressed;		// a compressor was run
+	bool done;
+    };
+
+    void submit();			// page is full; send it off
+    bool write_next(bool wait);		// write the oldest page if it is done
+    void write_done(bool all);		// write finished pages in order; all waits for every one
+    void write_page(job *j);
+    void write_af(const unsigned char *buf,uint64_t offset,uint32_t n); // through af_write
+    void spill();			// pending pages out, partial page to af_write
+    void compress(job *j);
+    void run();				// worker thread
+
+    AFFILE *af;
+    class auto_compress *ac;		// decides which pages to compress with -A
+    int comp_type;			// af's compression when we started, for -A
+    int comp_level;
+    uint32_t pagesize;
+    size_t   max_pending;
+
+    job     *page;			// the page being filled
+    uint32_t fill;			// bytes in page
+    uint64_t next_pos;			// where the next write continues page
+    bool     af_dirty;			// af_write may have left a partial page in af
+
+    std::mutex M;
+    std::condition_variable work_ready;	// signaled when a job is queued or we finish
+    std::condition_variable job_done;	// signaled when a job is compressed
+    std::deque<job *> queue;		// waiting for a worker
+    std::deque<job *> pending;		// submitted and not written, in page order
+    std::vector<job *> freelist;
+    bool finished;
+    std::vector<std::thread> threads;
+};
+
+#endif
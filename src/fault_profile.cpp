@@ -0,0 +1,67 @@
+/*
+ * fault_profile.cpp:
+ * The failing drive of --simulate_faults.
+ */
+
+#include "config.h"
+#include "fault_profile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+fault_profile::fault_profile():regions(),seed(1)
+{
+}
+
+bool fault_profile::parse(const char *spec,int sector_size)
+{
+    const char *cc = spec;
+    while(*cc){
+	char kind[16];
+	uint64_t first=0,last=0;
+	int arg = 0;
+	int n = 0;
+	if(sscanf(cc,"%15[a-z]:%" SCNu64 "%n",kind,&first,&n)!=2) return false;
+	cc += n;
+	last = first;
+	if(*cc=='-'){
+	    if(sscanf(cc,"-%" SCNu64 "%n",&last,&n)!=1 || last<first) return false;
+	    cc += n;
+	}
+	if(*cc=='@'){
+	    if(sscanf(cc,"@%d%n",&arg,&n)!=1 || arg<0) return false;
+	    cc += n;
+	}
+	region r = {first*sector_size,(last+1)*sector_size,kind[0],arg};
+	if(strcmp(kind,"bad")==0){
+	    if(arg) return false;
+	}
+	else if(strcmp(kind,"slow")!=0 && strcmp(kind,"flaky")!=0){
+	    return false;
+	}
+	regions.push_back(r);
+	if(*cc==',') cc++;
+	else if(*cc) return false;
+    }
+    return true;
+}
+
+bool fault_profile::fail(uint64_t offset,size_t len)
+{
+    bool failed = false;
+    int  ms = 0;
+    for(size_t i=0;i<regions.size();i++){
+	const region &r = regions[i];
+	if(offset+len <= r.start || offset >= r.end) continue;
+	switch(r.kind){
+	case 'b': failed = true; break;
+	case 's': ms += r.arg; break;
+	case 'f': if((int)(rand_r(&seed) % 100) < r.arg) failed = true; break;
+	}
+    }
+    if(ms) usleep(ms*1000);
+    return failed;
+}
@@ -0,0 +1,42 @@
+/*
+ * fault_profile.h:
+ * Make a healthy input behave like a failing drive (--simulate_faults),
+ * so that the error handling can be tried and timed without one.
+ *
+ * A profile is a comma-separated list of regions, in sectors, with
+ * the end sector included:
+ *    bad:S[-E]       reads that touch S..E fail with EIO
+ *    slow:S-E@ms     reads that touch S..E take ms milliseconds longer
+ *    flaky:S-E@pct   reads that touch S..E fail pct percent of the time
+ * For example "bad:1000,bad:50000-51999,slow:80000-99999@20".
+ *
+ * As on a real drive, a read that touches a bad sector fails as a
+ * whole; it takes reads of the sectors around it to get them. The
+ * flaky failures come from a fixed seed, so a run can be repeated.
+ */
+
+#ifndef FAULT_PROFILE_H
+#define FAULT_PROFILE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+class fault_profile {
+public:
+    fault_profile();
+    bool parse(const char *spec,int sector_size); // false if spec is malformed
+    bool fail(uint64_t offset,size_t len);	// sleeps as needed; true if the read fails
+
+private:
+    struct region {
+	uint64_t start;			// in bytes
+	uint64_t end;			// just past the last byte
+	char	 kind;			// 'b'ad, 's'low or 'f'laky
+	int	 arg;			// ms or pct
+    };
+    std::vector<region> regions;
+    unsigned int seed;
+};
+
+#endif
@@ -279,6 +279,7 @@ void my_refresh(imager *im,struct affcallback_info *acbi)
     printf("Total blank sectors: %" PRIu64 "\n", im->total_blank_sectors);
     printf("Total bad sectors: %" PRIu64 "\n", im->bad_sectors_read);
 	printf("Consecutive bad regions: %d\n",im->consecutive_read_error_regions);
+	if(im->error_recovery_phase) printf("Recovery pass: %d\n",im->error_recovery_phase);
 	printf("Bytes read: %" PRIu64 "\n", im->total_bytes_read);
     printf("Bytes written: %" PRIu64 "\n", im->callback_bytes_written);
 	if(acbi) printf("Current phase: %d\n",acbi->phase);
@@ -389,6 +390,11 @@ void my_refresh(imager *im,struct affcallback_info *acbi)
 	    printw(" (%d consecutive bad regions)",
 		   im->consecutive_read_error_regions);
 	}
+	if(im->error_recovery_phase){
+	    static const char *pass_names[] = {"","copying","copying skipped areas","trimming","scraping"};
+	    printw(" (recovery pass %d: %s)",im->error_recovery_phase,
+		   pass_names[im->error_recovery_phase]);
+	}
     }
     clrtoeol();
 
@@ -411,7 +417,7 @@ void my_refresh(imager *im,struct affcallback_info *acbi)
     }
 
     if(im->callback_bytes_to_write>0 && im->callback_bytes_written>0 && acbi && acbi->af){
-	if(af_compression_type(acbi->af)==AF_COMPRESSION_ALG_NONE){
+	if(af_compression_type(acbi->af)==AF_COMPRESSION_ALG_NONE && im->ac==0){
 	    mvprintw(compression_row,0,"%s", "");
 	    clrtoeol();
 	}
@@ -0,0 +1,147 @@
+/*
+ * hash_bench.cpp:
+ * How fast the hash_t.h generators are at the buffer sizes the imager
+ * hands them, from a sector up to a 64MB read, on 1 to n threads.
+ * Each thread has its own generator and hashes the same buffer over
+ * and over; the result is the total for all of the threads, in GB/s.
+ * It also times a whole hash of a single sector, which is mostly the
+ * cost of setting up and finishing an EVP context.
+ *
+ * Built and run by "make bench-hash".
+ * usage: hash_bench [-s seconds per test] [-t max threads]
+ */
+
+#include "config.h"
+#include "hash_t.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <openssl/crypto.h>
+#include <vector>
+#include <thread>
+#include <chrono>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#endif
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double seconds_since(bench_clock::time_point t0)
+{
+    return std::chrono::duration<double>(bench_clock::now()-t0).count();
+}
+
+/* Hash buf as bufsize chunks on nthreads threads for about secs seconds */
+template<typename T>
+static double throughput(const uint8_t *buf,size_t bufsize,int nthreads,double secs)
+{
+    std::vector<uint64_t> bytes(nthreads);
+    std::vector<std::thread> threads;
+    bench_clock::time_point t0 = bench_clock::now();
+    for(int i=0;i<nthreads;i++){
+	threads.push_back(std::thread([&bytes,i,buf,bufsize,secs,t0]{
+		    hash_generator__<T> g;
+		    do {
+			g.update(buf,bufsize);
+			bytes[i] += bufsize;
+		    } while(seconds_since(t0) < secs);
+		    g.final();
+		}));
+    }
+    for(int i=0;i<nthreads;i++) threads[i].join();
+    double elapsed = seconds_since(t0);
+    uint64_t total = 0;
+    for(int i=0;i<nthreads;i++) total += bytes[i];
+    return total / elapsed / 1e9;
+}
+
+/* Microseconds to hash one sector from scratch */
+template<typename T>
+static double context_us(const uint8_t *buf,double secs)
+{
+    uint64_t n = 0;
+    bench_clock::time_point t0 = bench_clock::now();
+    do {
+	for(int i=0;i<1000;i++){
+	    hash_generator__<T>::hash_buf(buf,512);
+	}
+	n += 1000;
+    } while(seconds_since(t0) < secs);
+    return seconds_since(t0) * 1e6 / n;
+}
+
+template<typename T>
+static void bench(const char *name,const uint8_t *buf,const std::vector<size_t> &sizes,
+		  const std::vector<int> &nthreads,double secs)
+{
+    for(size_t s=0;s<sizes.size();s++){
+	for(size_t t=0;t<nthreads.size();t++){
+	    printf("%s,%zu,%d,%.3f\n",name,sizes[s],nthreads[t],
+		   throughput<T>(buf,sizes[s],nthreads[t],secs));
+	    fflush(stdout);
+	}
+    }
+    printf("# %s: %.2f us to hash one sector with a new context\n",name,context_us<T>(buf,secs));
+}
+
+static void cpu_features()
+{
+    printf("# %s\n",OpenSSL_version(OPENSSL_VERSION));
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    unsigned int eax=0,ebx=0,ecx=0,edx=0;
+    bool sha_ni = __get_cpuid_count(7,0,&eax,&ebx,&ecx,&edx) && (ebx & (1<<29));
+    printf("# CPU:%s%s%s%s\n",
+	   sha_ni ? " sha_ni" : "",
+	   __builtin_cpu_supports("ssse3") ? " ssse3" : "",
+	   __builtin_cpu_supports("avx2") ? " avx2" : "",
+	   __builtin_cpu_supports("avx512f") ? " avx512f" : "");
+#endif
+}
+
+static void usage()
+{
+    fprintf(stderr,"usage: hash_bench [-s seconds per test] [-t max threads]\n");
+    exit(1);
+}
+
+int main(int argc,char **argv)
+{
+    double secs = 0.5;
+    int max_threads = std::thread::hardware_concurrency();
+    int ch;
+    while((ch = getopt(argc,argv,"s:t:h"))!=-1){
+	switch(ch){
+	case 's': secs = atof(optarg); break;
+	case 't': max_threads = atoi(optarg); break;
+	default: usage();
+	}
+    }
+    if(max_threads<1) max_threads = 1;
+
+    std::vector<size_t> sizes;
+    for(size_t s=512;s<=64*1024*1024;s*=4){	// 512 bytes to 32MB, by 4
+	sizes.push_back(s);
+    }
+    sizes.push_back(64*1024*1024);
+    std::vector<int> nthreads;
+    for(int t=1;t<max_threads;t*=2) nthreads.push_back(t);
+    nthreads.push_back(max_threads);
+
+    /* The threads all read the one buffer */
+    std::vector<uint8_t> buf(sizes.back());
+    srandom(1);
+    for(size_t i=0;i<buf.size();i++) buf[i] = random();
+
+    cpu_features();
+    printf("algorithm,bufsize,threads,gb_per_second\n");
+    bench<md5_>("md5",buf.data(),sizes,nthreads,secs);
+    bench<sha1_>("sha1",buf.data(),sizes,nthreads,secs);
+    bench<sha256_>("sha256",buf.data(),sizes,nthreads,secs);
+#ifdef HAVE_EVP_SHA512
+    bench<sha512_>("sha512",buf.data(),sizes,nthreads,secs);
+#endif
+    return 0;
+}
@@ -258,6 +258,28 @@ public:
         return val;
     }
 
+    /* The hash of what has been given to update() so far, without
+     * finishing it; update() can still be called afterwards.
+     */
+    hash__<T> peek() {
+        if (!initialized)
+            init();
+
+        EVP_MD_CTX *copy = EVP_MD_CTX_new();
+        if (!copy || EVP_MD_CTX_copy_ex(copy, mdctx) != 1) {
+            std::cerr << "EVP_MD_CTX_copy_ex failed\n";
+            std::abort();
+        }
+        hash__<T> val;
+        unsigned int len = static_cast<unsigned int>(sizeof(val.digest));
+        if (EVP_DigestFinal_ex(copy, val.digest, &len) != 1) {
+            std::cerr << "EVP_DigestFinal_ex failed\n";
+            std::abort();
+        }
+        EVP_MD_CTX_free(copy);
+        return val;
+    }
+
     static hash__<T> hash_buf(const uint8_t *buf, size_t bufsize) {
         hash_generator__ g;
         g.update(buf, bufsize);
@@ -3,6 +3,20 @@
 #include "ident.h"
 #include "imager.h"
 #include "gui.h"
+#include "threaded_hash.h"
+#include "read_ahead.h"
+#include "chunk_tuner.h"
+#include "compress_pipeline.h"
+#include "auto_compress.h"
+#include "zero_detect.h"
+#include "sector_map.h"
+#include "recovery.h"
+#include "fault_profile.h"
+#include "input_source.h"
+#include "window_hash.h"
+#include "verify.h"
+
+#include <afflib/utils.h>
 
 #include <stdio.h>
 #include <unistd.h>
@@ -18,6 +32,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <algorithm>
 
 #ifdef HAVE_NETINET_IN_H
 #include <netinet/in.h>
@@ -41,6 +56,9 @@
 
 int opt_multithreaded=0;
 
+static const uint64 min_blank_run = 16*1024*1024; // shorter blank runs are mapped as GOOD
+static const size_t max_map_segment = 0xffffffffU; // af_update_seg() takes a 32-bit length
+
 imager::imager()
 {
     allow_regular = false;
@@ -61,6 +79,14 @@ imager::imager()
     last_sector_read = 0;	// sector number
     bad_sectors_read = 0;
     af = 0;
+    th = 0;
+    tuner = 0;
+    cp = 0;
+    ac = 0;
+    smap = 0;
+    wh = 0;
+    rb = 0;
+    write_pos = 0;
     hash_invalid = false;		// make true to avoid hash calculation
 
     memset(cmd_attach,0,sizeof(cmd_attach));
@@ -78,6 +104,10 @@ imager::imager()
 
     in     = -1;
     in_pos = 0;
+    src    = 0;
+    direct_io   = false;
+    in_buffered = -1;
+    io_align    = 0;
     sector_size = 0;
     total_sectors = 0;
     maxreadblocks = 0;
@@ -97,15 +127,20 @@ imager::imager()
 
     buf = 0;
     bufsize = 512;			// good guess
-    memset(blank_sector,0,sizeof(blank_sector));
     partial_sector_left  = 0;
     partial_sector_blank = false;
+    blank_start = 0;
+    blank_len   = 0;
 
     bad_sectors_read = 0;
     consecutive_read_errors = 0;
     consecutive_read_error_regions = 0;
     error_recovery_phase = 0;
+    bisect_reads = 0;
+    slow_read_ms = 0;
     last_direction = 0;
+    faults = 0;
+    last_checkpoint = 0;
 
     output_ident = 0;
 
@@ -154,53 +189,69 @@ void imager::write_data(unsigned char *buf,uint64 offset,int len)
 
     if(!hash_invalid){
 		/* Update hash functions. */
-		th_md5.update(buf,len);
-		th_sha1.update(buf,len);
-		th_sha256.update(buf,len);
+		if(th){
+		    th->update(buf,len);	// hashed in the other thread
+		}
+		else {
+		    th_md5.update(buf,len);
+		    th_sha1.update(buf,len);
+		    th_sha256.update(buf,len);
+		}
     }
 
-    /* Count the number of blank sectors.
+    /* An offset of 0 means "where the last write ended" only for an input
+     * of unknown size, which is always read in order. Otherwise it is
+     * sector 0, which comes last when going backwards.
      */
-    /* First, see if there is a partial blank sector that we are still processing... */
-    int len_left = len;
-    while(len_left>0 && partial_sector_left>0){
-	if(buf[len-len_left] != 0){
-	    partial_sector_blank = false; // it's no longer blank
-	}
-	len_left--;
-	partial_sector_left--;
+    uint64 where = (offset==0 && total_sectors==0) ? write_pos : offset;
+    if(smap) smap->mark(where,len,sector_map::GOOD);
+    if(where!=blank_start+blank_len && where+len!=blank_start){
+	blank_len = 0;			// not next to the blank run, so it has ended
     }
-    if(partial_sector_left==0){ // we reached the end of the partial sector
-	if(partial_sector_blank==true){	// and the sector is blank!
+    if(wh) wh->write(buf,where,len);
+
+    /* Count the number of blank sectors.
+     * A sector may be split across calls; finish off the one that
+     * the last call started before looking at whole sectors.
+     */
+    int pos = 0;
+    if(partial_sector_left>0){
+	int n = len < partial_sector_left ? len : partial_sector_left;
+	if(!buffer_is_zero(buf,n)) partial_sector_blank = false;
+	partial_sector_left -= n;
+	pos = n;
+	if(partial_sector_left==0 && partial_sector_blank){
 	    total_blank_sectors++;
 	}
     }
-    /* Is it possible to look for full sectors? */
-    while(len_left > sector_size){
-	if(memcmp(buf+(len-len_left),blank_sector,sector_size)==0){
-	    total_blank_sectors++;
+    if(partial_sector_left==0){
+	int whole_sectors = (len-pos) / sector_size;
+	uint64 blanks = count_zero_sectors(buf+pos,whole_sectors,sector_size);
+	total_blank_sectors += blanks;
+	if(smap && blanks==(uint64)whole_sectors){
+	    map_blank(where+pos,(uint64)whole_sectors*sector_size);
 	}
-	len_left -= sector_size;
-    }
-
-    if(partial_sector_left==0 && len_left>0){ // some left, so we have a new partial sector
-	partial_sector_left  = sector_size;
-	partial_sector_blank = true;
-    }
+	else if(smap && blanks>0){
+	    map_blank_sectors(where+pos,buf+pos,whole_sectors);
+	}
+	pos += whole_sectors * sector_size;
 
-    /* If anything is left, do the partial sector */
-    while(len_left>0){
-	if(buf[len-len_left] != 0){
-	    partial_sector_blank = false; // no longer blank
+	if(pos<len){			// start of a sector that the next call finishes
+	    partial_sector_left  = sector_size - (len-pos);
+	    partial_sector_blank = buffer_is_zero(buf+pos,len-pos);
 	}
-	len_left--;
-	partial_sector_left--;
     }
 
 
     /* Write it out and carry on... */
-    if(offset) af_seek(af,offset,SEEK_SET);
-    if(af_write(af,buf,len)!=len){
+    write_pos = where + len;
+    if(cp){
+	cp->write(buf,where,len);	// compressed and written in page order
+	total_bytes_written += len;
+	return;
+    }
+    af_seek(af,where,SEEK_SET);
+    if((ac ? write_auto(buf,len) : af_write(af,buf,len))!=len){
 	perror("af_write");	// this is bad
 	af_close(af);	// try to gracefully recover
 	fprintf(stderr,"\r\n");
@@ -210,6 +261,85 @@ void imager::write_data(unsigned char *buf,uint64 offset,int len)
     total_bytes_written   += len;
 }
 
+/* Add len blank bytes at pos to the blank run. Only runs of at least
+ * min_blank_run bytes go in the sector map; scattered blank sectors
+ * would each be an extent, and on a large drive the map would grow
+ * without bound. The run may carry on in either direction, as the
+ * drive may be read in reverse, so it is marked again each time it
+ * grows.
+ */
+void imager::map_blank(uint64 pos,uint64 len)
+{
+    if(blank_len && pos==blank_start+blank_len){
+	blank_len += len;
+    }
+    else if(blank_len && pos+len==blank_start){
+	blank_start = pos;
+	blank_len  += len;
+    }
+    else {
+	blank_start = pos;
+	blank_len   = len;
+    }
+    if(blank_len>=min_blank_run){
+	smap->mark(blank_start,blank_len,sector_map::BLANK);
+    }
+}
+
+/* Map the blank sectors among nsectors at buf, which came from pos.
+ * The run that the next write may carry on goes to map_blank() last:
+ * the one at the end going forwards, the one at the start in reverse.
+ */
+void imager::map_blank_sectors(uint64 pos,const unsigned char *buf,int nsectors)
+{
+    std::vector<std::pair<int,int> > runs; // first sector, count
+    int i = 0;
+    while(i<nsectors){
+	if(!buffer_is_zero(buf+(size_t)i*sector_size,sector_size)){
+	    i++;
+	    continue;
+	}
+	int run = 1;
+	while(i+run<nsectors && buffer_is_zero(buf+(size_t)(i+run)*sector_size,sector_size)){
+	    run++;
+	}
+	runs.push_back(std::make_pair(i,run));
+	i += run;
+    }
+    if(last_direction<0) std::reverse(runs.begin(),runs.end());
+    for(size_t j=0;j<runs.size();j++){
+	map_blank(pos+(uint64)runs[j].first*sector_size,(uint64)runs[j].second*sector_size);
+    }
+}
+
+/* write_auto:
+ * af_write for -A. Each page is compressed or not depending on what
+ * is in it, so set the compression just before the write that completes
+ * a page, and have afflib write the page out right then.
+ */
+int imager::write_auto(unsigned char *buf,int len)
+{
+    uint32_t pagesize = af_get_pagesize(af);
+    int done = 0;
+    while(done<len){
+	uint64 pos = af_tell(af);
+	int n = pagesize - pos % pagesize;
+	if(n > len-done) n = len-done;
+	ac->add(buf+done,n);
+
+	bool page_complete = (pos+n) % pagesize == 0;
+	if(page_complete){
+	    af_enable_compression(af,ac->decide() ? opt_compression_alg : AF_COMPRESSION_ALG_NONE,
+				  opt_compression_level);
+	}
+	int written = af_write(af,buf+done,n);
+	if(written!=n) return written<0 ? written : done+written;
+	if(page_complete) af_cache_flush(af);
+	done += n;
+    }
+    return done;
+}
+
 void imager::status()
 {
     if(opt_quiet==0 && opt_silent==0){
@@ -304,7 +434,7 @@ int  imager::open_dev(const char *friendly_name)
 			isleep(delay);
 		    }	
 		    strcpy(infile,dev[d]); // we will try this one
-		    int fd = open(infile,O_RDONLY);
+		    int fd = open_input(infile);
 		    if(fd>0){
 			/* The device was successfully opened. */
 			return fd;		// got it!
@@ -337,7 +467,7 @@ int  imager::open_dev(const char *friendly_name)
      ****************************************************************/
     if(sscanf(friendly_name,"scsi%d",&scsi_bus)==1){
 	if(scsi_attach(infile,sizeof(infile),this)==0){
-	    int fd = open(infile,O_RDONLY);
+	    int fd = open_input(infile);
 	    if(fd>0){
 		return fd;
 	    }
@@ -353,6 +483,159 @@ int  imager::open_dev(const char *friendly_name)
 
 
 
+/*
+ * open_input:
+ * Open a file or device for reading. With --direct, open it with O_DIRECT
+ * so that the data we read does not go through the buffer cache.
+ * O_DIRECT reads must be aligned to the device's block size, so a second,
+ * buffered descriptor is kept for the reads that aren't (such as a
+ * partial block at the end of a file).
+ */
+int imager::open_input(const char *name)
+{
+    int fd = open(name,O_RDONLY);
+    if(fd<0 || opt_direct==0) return fd;
+
+#ifdef O_DIRECT
+    int dfd = open(name,O_RDONLY|O_DIRECT);
+    if(dfd<0){
+	warn("%s: cannot open with O_DIRECT; using buffered reads",name);
+	return fd;
+    }
+    if(in_buffered>=0) close(in_buffered); // left from an earlier attempt
+    in_buffered = fd;
+    direct_io   = true;
+    return dfd;
+#else
+#ifdef F_NOCACHE
+    fcntl(fd,F_NOCACHE,1);		// MacOS; no alignment restrictions
+    direct_io = true;
+#else
+    warnx("O_DIRECT is not supported on this system; using buffered reads");
+#endif
+    return fd;
+#endif
+}
+
+/* Mark bytes [from,to) of buf, which were not read, with the bad flag.
+ * The flag repeats every sector, as if all of buf had been filled with
+ * it before the read.
+ */
+void imager::fill_badflag(unsigned char *buf,int from,int to)
+{
+    int i = from;
+    if(i % sector_size){		// finish the sector the read stopped in
+	int n = sector_size - i % sector_size;
+	if(n > to-i) n = to-i;
+	memcpy(buf+i,badflag + i % sector_size,n);
+	i += n;
+    }
+    for(;i<to;i+=sector_size){
+	memcpy(buf+i,badflag,to-i < sector_size ? to-i : sector_size);
+    }
+}
+
+/* Get the badflag that we'll be using */
+void imager::get_badflag()
+{
+    badflag = (unsigned char *)malloc(sector_size);
+    if(af) memcpy(badflag,af_badflag(af),sector_size);
+    else memset(badflag,0,sector_size);
+}
+
+void imager::free_badflag()
+{
+    free(badflag);
+    badflag = 0;
+}
+
+/* Read len bytes at offset, for the code that reads out of order. */
+int imager::read_input(unsigned char *rbuf,uint64 offset,int len)
+{
+    if(opt_debug==99) return -1;	// simulate a read error
+    if(opt_debug==98) simulate_slow_read(offset,len);
+    if(faults && faults->fail(offset,len)){
+	errno = EIO;
+	return -1;
+    }
+    return src->pread(rbuf,len,offset);
+}
+
+/* A read of len bytes at offset into buf has failed. Read each half
+ * again, and split the halves that fail, down to single sectors, so
+ * that only the sectors that really can't be read get the bad flag.
+ * A short read means that what it returned is good, so only the rest
+ * is split. The offsets of the bad sectors are added to bad.
+ */
+void imager::isolate_errors(unsigned char *rbuf,uint64 offset,int len,std::vector<uint64> &bad)
+{
+    if(len<=sector_size){
+	bad.push_back(offset);
+	return;
+    }
+    int half = len/2 - (len/2) % sector_size;
+    int part_len[2] = {half,len-half};
+    int part_off = 0;
+    for(int i=0;i<2;i++){
+	int plen = part_len[i];
+	bisect_timer.start();
+	int got = read_input(rbuf+part_off,offset+part_off,plen);
+	bisect_timer.stop();
+	bisect_reads++;
+	if(got!=plen){
+	    int good = got>0 ? got - got % sector_size : 0;
+	    isolate_errors(rbuf+part_off+good,offset+part_off+good,plen-good,bad);
+	}
+	part_off += plen;
+    }
+}
+
+/* -d98: pretend that the second quarter of the input is on a weak
+ * part of the drive, where every read takes a long time.
+ */
+void imager::simulate_slow_read(uint64 offset,int len)
+{
+    uint64 size = total_sectors * sector_size;
+    if(offset+len > size/4 && offset < size/2){
+	int ms = opt_slow_read>0 ? opt_slow_read*2 : 1000;
+	usleep(ms*1000);
+    }
+}
+
+/* Read the regions that the watchdog put off, now that everything else
+ * is in. This time they are read the ordinary way, however slow.
+ */
+void imager::read_deferred()
+{
+    int watchdog = slow_read_ms;
+    slow_read_ms = 0;
+    for(size_t i=0;i<deferred.size();i++){
+	uint64 pos = deferred[i].first * sector_size;
+	uint64 end = deferred[i].second * sector_size;
+	uint64 start = 0;
+	uint64 len = 0;
+	/* Only what is still unread; reading backwards may have got some of it */
+	while(pos<end && smap->find(sector_map::UNREAD,pos,&start,&len) && start<end){
+	    uint64 stop = start+len < end ? start+len : end;
+	    image_loop(start/sector_size,stop/sector_size,1,opt_readsectors,opt_error_mode);
+	    pos = stop;
+	}
+    }
+    slow_read_ms = watchdog;
+}
+
+/*
+ * aligned_buf:
+ * Allocate a buffer that can be used for O_DIRECT reads.
+ */
+static unsigned char *aligned_buf(size_t bytes)
+{
+    void *p = 0;
+    if(posix_memalign(&p,4096,bytes)) return 0;
+    return (unsigned char *)p;
+}
+
+
 /*
  * main image loop.
  * if high_water_mark==0, then we do not know how many blocks the input
@@ -364,29 +647,54 @@ void imager::image_loop(uint64 low_water_mark, // sector # to start
 {
     // buffer to store the data we read
     bufsize = readsectors*sector_size;
-    buf = (unsigned char *)malloc(bufsize); 
+    unsigned char *readbuf = aligned_buf(bufsize);
+    buf = readbuf;
     memset(buf,0,sizeof(buf));
     uint64 data_offset = 0;		// offset into output file
     bool valid_reverse_data = false;		// did we ever get valid data in the reverse direction?
     bool last_read_short = false;
     int reminder = 0;
+    uint64 defer_sectors = readsectors;	// how far to skip after a slow read
+    const bool size_known = high_water_mark!=0; // going backwards takes it down to 0
 
     if(!buf) err(1,"malloc");
 
-    /* Get the badflag that we'll be using */
-    badflag = (unsigned char *)malloc(sector_size);
-    if(af) memcpy(badflag,af_badflag(af),sector_size);
-    else memset(badflag,0,sector_size);
+    get_badflag();
+
+    /* Start the reader thread if we know where the input ends.
+     * It reads ahead as long as we are going forward without errors.
+     */
+    read_ahead *ra = 0;
+    read_ahead::block *block = 0;	// what ra read for us
+    int ra_bufsize = readsectors;	// the largest forward read
+    if(ra_bufsize > (int)maxreadblocks && maxreadblocks>0) ra_bufsize = maxreadblocks;
+    ra_bufsize *= sector_size;
+    int ra_chunk = tuner ? tuner->sectors()*sector_size : ra_bufsize; // what each forward read will be
+    if((opt_read_buffers>0 || opt_io_uring>0) && size_known && src->fd()>=0 &&
+       opt_debug!=99 && opt_debug!=98 && !faults){
+	ra = new read_ahead(src->fd(),opt_read_buffers,ra_bufsize,sector_size,opt_io_uring);
+	if(direct_io && io_align>0) ra->set_unaligned_fd(in_buffered,io_align);
+	if(direction==1){
+	    ra->start(low_water_mark*sector_size,high_water_mark*sector_size,ra_chunk);
+	}
+    }
 
     /* Loop as long as we have room, or until we get an EOF
      * (if high_water_mark is 0.)
      */
     imaging = true;
-    while(low_water_mark < high_water_mark || high_water_mark==0){ 
+    while(low_water_mark < high_water_mark || !size_known){ 
+
+	/* Give back the reader's block from the last time through */
+	if(block){
+	    ra->release(block);
+	    block = 0;
+	}
+	buf = readbuf;
 
 	/* Figure out where to read and how how many sectors to read */
 	uint64 snum;	// where we will be reading
-	unsigned int sectors_to_read = readsectors;
+	unsigned int sectors_to_read = tuner ? tuner->sectors() : readsectors;
 	if(sectors_to_read > maxreadblocks && maxreadblocks>0){
 	    sectors_to_read = maxreadblocks;
 	}
@@ -394,7 +702,7 @@ void imager::image_loop(uint64 low_water_mark, // sector # to start
 	    snum = low_water_mark;
 
 	    /* If a high water mark is set, take it into account */
-	    if(high_water_mark>0){
+	    if(size_known){
 		unsigned int sectors_left = high_water_mark - snum;
 		if(sectors_left < sectors_to_read){ 
 		    sectors_to_read = sectors_left;
@@ -402,48 +710,71 @@ void imager::image_loop(uint64 low_water_mark, // sector # to start
 	    }
 	}
 	else {
-	    assert(high_water_mark != 0); // we can't go backwards if we don't know end
-	    snum = high_water_mark - sectors_to_read;
-	    if(snum<low_water_mark){
+	    assert(size_known); // we can't go backwards if we don't know end
+	    if(high_water_mark < low_water_mark + sectors_to_read){ // don't go below zero
 		snum = low_water_mark;
 		sectors_to_read = high_water_mark - low_water_mark;
 	    }
+	    else {
+		snum = high_water_mark - sectors_to_read;
+	    }
 	}
 
 	last_sector_read = snum;
 	last_sectors_read = sectors_to_read;
 	last_direction = direction;
 
-	if (high_water_mark != 0){ 	// if we know where the top is...
+	if (size_known){ 	// if we know where the top is...
 	    data_offset = sector_size * snum; // where we want to start reading
-
-	    if(data_offset != in_pos){	// eliminate unnecessary seeks
-		lseek(in,data_offset,SEEK_SET);	// make sure we are at the right place; (ignore error)
-		in_pos = data_offset;
-	    }
 	}
 
 	status();			// tell the user what we are doing
 
 	int bytes_to_read = sectors_to_read * sector_size;
-
-	/* Fill the buffer that we are going to read with the bad flag */
-	for(int i=0;i<bytes_to_read;i+=sector_size){
-	    memcpy(buf+i,badflag,sector_size);
-	}
-
-	/* Now seek and read */
-
 	int bytes_read    = 0;
-	if(opt_debug==99){
-	    bytes_read = -1; // simulate a read error
-	} else {
+	double read_seconds = 0;	// how long the read took
+
+	/* See if the reader thread has already read this for us */
+	if(ra){
 	    if(opt_use_timers) read_timer.start();
-	    bytes_read = read(in,buf,bytes_to_read);
+	    block = ra->get(data_offset,bytes_to_read);
 	    if(opt_use_timers) read_timer.stop();
+	    if(block){
+		buf = block->buf;
+		bytes_read = block->bytes_read;
+		read_seconds = block->seconds;
+	    }
+	    else {
+		ra->stop();		// it guessed wrong; we will read it ourselves
+	    }
 	}
-	if(bytes_read>=0){
-	    in_pos += bytes_read;	// update position
+
+	if(!block){
+	    if(size_known && data_offset != in_pos){	// eliminate unnecessary seeks
+		src->seek(data_offset);	// make sure we are at the right place; (ignore error)
+		in_pos = data_offset;
+	    }
+
+	    /* Now read */
+	    if(opt_debug==99){
+		bytes_read = -1; // simulate a read error
+	    } else {
+		double t0 = read_timer.elapsed_seconds();
+		if(opt_use_timers || tuner || slow_read_ms) read_timer.start();
+		if(opt_debug==98) simulate_slow_read(data_offset,bytes_to_read);
+		if(faults && faults->fail(data_offset,bytes_to_read)){
+		    bytes_read = -1;
+		    errno = EIO;
+		}
+		else {
+		    bytes_read = src->read(buf,bytes_to_read);
+		}
+		if(opt_use_timers || tuner || slow_read_ms) read_timer.stop();
+		read_seconds = read_timer.elapsed_seconds() - t0;
+	    }
+	    if(bytes_read>=0){
+		in_pos += bytes_read;	// update position
+	    }
 	}
 
 	/* Note if we got valid data in the reverse direction */
@@ -460,15 +791,54 @@ void imager::image_loop(uint64 low_water_mark, // sector # to start
 	    consecutive_read_error_regions = 0;
 	    last_read_short = false;
 
+	    /* Let the tuner see how fast that was. If it wants a different
+	     * read size, restart the reader thread with the new size.
+	     */
+	    if(tuner && direction==1 && (int)sectors_to_read==tuner->sectors()){
+		tuner->record(bytes_read,read_seconds);
+		if(tuner->sectors()*sector_size != ra_chunk){
+		    ra_chunk = tuner->sectors()*sector_size;
+		    if(ra){
+			ra->start((low_water_mark+sectors_to_read)*sector_size,
+				  high_water_mark*sector_size,ra_chunk);
+		    }
+		}
+	    }
+
+	    /* If we are going forward, (re)start the reader thread on what follows */
+	    if(ra && direction==1 && !ra->active()){
+		ra->start((low_water_mark+sectors_to_read)*sector_size,
+			  high_water_mark*sector_size,ra_chunk);
+	    }
+
 	    /* Write the data! */
 	    write_data(buf,data_offset,bytes_read);
 
 	    if(direction==1){
 		low_water_mark += sectors_to_read;
+
+		/* A read that slow means the drive is struggling here. Skip
+		 * ahead, further each time in a row, and come back at the end.
+		 */
+		if(slow_read_ms>0 && size_known && read_seconds*1000 > slow_read_ms){
+		    uint64 skip = defer_sectors;
+		    if(skip > high_water_mark-low_water_mark) skip = high_water_mark-low_water_mark;
+		    if(skip>0){
+			deferred.push_back(std::make_pair(low_water_mark,low_water_mark+skip));
+			low_water_mark += skip;
+			hash_invalid = true;	// no longer read in order
+			if(ra) ra->start(low_water_mark*sector_size,high_water_mark*sector_size,ra_chunk);
+		    }
+		    if(defer_sectors < total_sectors/100) defer_sectors *= 2;
+		}
+		else {
+		    defer_sectors = readsectors;
+		}
 	    }
 	    else {
 		high_water_mark -= sectors_to_read;
 	    }
+	    checkpoint_if_due();
 	    continue;
 	}
 
@@ -478,7 +848,7 @@ void imager::image_loop(uint64 low_water_mark, // sector # to start
 	 * then just write out what we read and continue, because we don't know how many
 	 * bytes we can read...
 	 */
-	if(high_water_mark==0 && bytes_read<=0){
+	if(!size_known && bytes_read<=0){
 	    break;	// end of pipe/file/whatever
 	}
 
@@ -503,6 +873,7 @@ void imager::image_loop(uint64 low_water_mark, // sector # to start
 	     */
 	    if(++consecutive_read_errors>retry_count){
 		consecutive_read_errors=0; // reset the counter
+		bool resolved = false;	// every sector of the read was written
 
 		/* If we got an error, note it --- unless one of two conditions are true:
 		 * we are going forwards and the last was a short read.
@@ -510,12 +881,34 @@ void imager::image_loop(uint64 low_water_mark, // sector # to start
 		 */
 		if(((direction==1) && (last_read_short==false)) ||
 		   ((direction==-1) && (valid_reverse_data==true))){
+		    /* Find the sectors that are really bad, and flag just those */
+		    int good = bytes_read>0 ? bytes_read - bytes_read % sector_size : 0;
+		    std::vector<uint64> bad;
+		    isolate_errors(buf+good,data_offset+good,bytes_to_read-good,bad);
+		    for(size_t i=0;i<bad.size();i++){
+			int at = (int)(bad[i]-data_offset);
+			fill_badflag(buf,at,at+sector_size);
+		    }
 		    write_data(buf,data_offset,bytes_to_read);
-		    bad_sectors_read += sectors_to_read; // I'm giving up on them...
+		    for(size_t i=0;i<bad.size();i++){
+			if(smap) smap->mark(bad[i],sector_size,sector_map::BAD);
+		    }
+		    bad_sectors_read += bad.size(); // I'm giving up on them...
+
+		    /* All of it is written now, so go on past it */
+		    if(direction==1) low_water_mark += sectors_to_read;
+		    else high_water_mark -= sectors_to_read;
+		    if(bad.empty()){
+			/* It all read in pieces; carry on as if it had read the first time */
+			consecutive_read_error_regions = 0;
+			continue;
+		    }
 		    hash_invalid = true;
+		    resolved = true;
 		}
 		
 		if(++consecutive_read_error_regions<retry_count){ //
+		    if(resolved) continue;	// already past it
 		    /* Just skip to the next area */
 		    int sectors_to_bump = readsectors / 2;
 		    if(sectors_to_bump==0) sectors_to_bump = 1;	// need to bump by a positive amount
@@ -559,8 +952,10 @@ void imager::image_loop(uint64 low_water_mark, // sector # to start
 	}
     }
     imaging = false;
-    free(buf); buf = 0;				// no longer valid
-    free(badflag); badflag = 0;
+    if(block) ra->release(block);
+    delete ra;					// stops the reader thread
+    free(readbuf); buf = 0;			// no longer valid
+    free_badflag();
 }
 
 /* Returns 0 if okay, -1 if failure. */
@@ -586,9 +981,9 @@ int imager::set_input_fd(int ifd)
 	sector_size = afb.sector_size;
 	total_sectors = afb.total_sectors;
 	maxreadblocks = afb.max_read_blocks;
-	return 0;
+	io_align = sector_size;		// the logical block size
     }
-    if(mode==S_IFREG){			// regular file
+    else if(mode==S_IFREG){			// regular file
 	if(allow_regular==false){
 	    fprintf(stderr,"input is a regular file.\n");
 	    fprintf(stderr,"Use afconvert or aimage -E to convert regular files to AFF.\n");
@@ -598,13 +993,17 @@ int imager::set_input_fd(int ifd)
 	sector_size  = 512;		// default
 	total_sectors= so.st_size / sector_size;
 	maxreadblocks = 0;
-	return 0;
+	/* The file system decides what O_DIRECT needs; st_blksize is safe */
+	io_align = so.st_blksize > sector_size ? so.st_blksize : sector_size;
     }
-
-    /* Okay. We don't know how big it will be, so just get what we can... */
-    sector_size   = 512;		// it's a good guess
-    total_sectors = 0;			// we don't know
-    maxreadblocks = 0;			// no limit
+    else {
+	/* Okay. We don't know how big it will be, so just get what we can... */
+	sector_size   = 512;		// it's a good guess
+	total_sectors = 0;			// we don't know
+	maxreadblocks = 0;			// no limit
+    }
+    delete src;
+    src = direct_io ? new fd_source(in,in_buffered,io_align) : new fd_source(in);
     return 0;
 }
 
@@ -631,11 +1030,27 @@ int imager::set_input(const char *name)
     if(sscanf(name,"listen:%d",&port)==1){
 	if(socket_listen(port)) return -1;	// sets infile
 	sector_size = 512;		// no rationale for picking anything else
+	src = new fd_source(in);
+	return 0;
+    }
+
+    /* Check for 'sim:...', a simulated drive (see input_source.h) */
+    if(strncmp(name,"sim:",4)==0){
+	sim_source *sim = sim_source::open(name+4);
+	if(!sim){
+	    fprintf(stderr,"%s: cannot make sense of the simulated drive\n",name);
+	    return -1;
+	}
+	strlcpy(infile,name,sizeof(infile));
+	sector_size   = sim->sector_size();
+	total_sectors = sim->size() / sector_size;
+	maxreadblocks = 0;
+	src = sim;
 	return 0;
     }
 
     /* The name must be a file. See if we can open it... */
-    int ifd = open(name,O_RDONLY);
+    int ifd = open_input(name);
     if(ifd>0){
 	strcpy(infile,name);		// make a local copy
 	return set_input_fd(ifd);
@@ -665,7 +1080,8 @@ void imager::hash_setup()
 
 /* start_recover_scan():
  * Do a recover scan...
- * Try to read all of the pages that are not in the image
+ * Try to read all of the pages that are not in the image.
+ * start_imaging() tidies up afterwards, as it does after imaging.
  */
 void imager::start_recover_scan()
 {
@@ -679,47 +1095,68 @@ void imager::start_recover_scan()
 	err(1,"af->image_pagesize not set. Cannot proceed with recover_scan");
     }
 
+    hash_invalid = true;		// only the missing pages are read
+
     int64 sectors_per_page = af->image_pagesize / af->image_sectorsize;
     int64 num_pages = (total_sectors+sectors_per_page-1) / sectors_per_page;
-    int *pages = (int *)calloc(sizeof(int *),num_pages);
     printf("There are %" PRId64 " pages...\n", num_pages);
-    /* Now figure out which pages we have.
-     */
+
+    /* Figure out which pages we have with one pass over the segment list */
+    std::vector<bool> have(num_pages,false);
+    aff::seglist segs(af);
+    for(aff::seglist::const_iterator it=segs.begin();it!=segs.end();++it){
+	int64 page = af_segname_page_number(it->name.c_str());
+	if(page>=0 && page<num_pages) have[page] = true;
+    }
+
+    /* Runs of missing pages, [first,second) */
+    std::vector<std::pair<int64,int64> > runs;
+    int64 missing_pages = 0;
     for(int64 i=0;i<num_pages;i++){
-	char segname[AF_MAX_NAME_LEN];
-	snprintf(segname,sizeof(segname),AF_PAGE,i);
-	if(af_get_seg(af,segname,0,0,0)){ // just probe for the segment's existence
-	    printf("Page %" PRId64 " is in the image...\r", i);
-	    pages[i]=1; // note that we have this page
-	}
+	if(have[i]) continue;
+	if(runs.size() && runs.back().second==i) runs.back().second++;
+	else runs.push_back(std::make_pair(i,i+1));
+	missing_pages++;
     }
+
     /* Print the missing pages: */
-    int missing_pages = 0;
     printf("Missing pages:\n");
-    for(int64 i=0;i<num_pages;i++){
-	if(pages[i]==0){
-	    printf("%" PRId64 " ", i);
-	    missing_pages++;
-	}
+    for(size_t i=0;i<runs.size();i++){
+	if(runs[i].second-runs[i].first==1) printf("%" PRId64 " ",runs[i].first);
+	else printf("%" PRId64 "-%" PRId64 " ",runs[i].first,runs[i].second-1);
     }
     printf("\n");
-    printf("Total missing pages: %d\n",missing_pages);
-    /* Now randomly try to get each of the missing pages */
+    printf("Total missing pages: %" PRId64 " in %d runs\n",missing_pages,(int)runs.size());
+
+    switch(opt_recover_order){
+    case RECOVER_REVERSE:
+	std::reverse(runs.begin(),runs.end());
+	break;
+    case RECOVER_RANDOM:
 #ifdef HAVE_SRANDOMDEV
-    srandomdev();
+	srandomdev();
 #endif
-    while(missing_pages>0){
-	int random_page = random() % num_pages;
-	while(pages[random_page]!=0) random_page = (++random_page) % num_pages;
-	printf("*** try for page %d\n",random_page);
-	uint64 start_sector = random_page * sectors_per_page;
-	uint64 end_sector   = start_sector + sectors_per_page;
-	image_loop(start_sector,end_sector,1,opt_readsectors,1);
-	pages[random_page] = 1;		// did that page
-	missing_pages--;
+	for(size_t i=runs.size();i>1;i--){
+	    std::swap(runs[i-1],runs[random() % i]);
+	}
+	break;
+    }
+
+    /* Read each run. Reading stops at an error, as it always has; when
+     * it does, go on with the page after the one with the error.
+     */
+    for(size_t i=0;i<runs.size();i++){
+	uint64 start_sector = runs[i].first * sectors_per_page;
+	uint64 end_sector   = runs[i].second * sectors_per_page;
+	if(end_sector>total_sectors) end_sector = total_sectors;
+	while(start_sector<end_sector){
+	    printf("*** try for pages %" PRId64 "-%" PRId64 "\n",
+		   (int64)(start_sector/sectors_per_page),(int64)((end_sector-1)/sectors_per_page));
+	    image_loop(start_sector,end_sector,1,opt_readsectors,1);
+	    if(last_sector_read + last_sectors_read >= end_sector) break;
+	    start_sector = (last_sector_read/sectors_per_page + 1) * sectors_per_page;
+	}
     }
-    free(pages);
-    exit(0);
 }
 
 
@@ -743,7 +1180,26 @@ void imager::start_imaging2()
     }
 
     int starting_direction = 1;
-    if(opt_reverse) starting_direction = -1;
+    if(opt_reverse){
+	starting_direction = -1;
+	hash_invalid = true;		// the MD5 etc. need the data in order
+    }
+
+    if(opt_simulate_faults){
+	if(total_sectors==0){
+	    errx(1,"--simulate_faults needs to know the size of the input");
+	}
+	faults = new fault_profile();
+	if(!faults->parse(opt_simulate_faults,sector_size)){
+	    errx(1,"--simulate_faults: cannot make sense of '%s'",opt_simulate_faults);
+	}
+    }
+
+    bool multipass = (opt_error_mode==2);
+    if(multipass && total_sectors==0){
+	fprintf(stderr,"-e2 needs to know the size of the input; using -e0\n");
+	multipass = false;
+    }
 
     /****************************************************************
      *** Start imaging
@@ -751,9 +1207,61 @@ void imager::start_imaging2()
 
     signal(SIGINT,sig_intr);	// set the signal handler
     hash_setup();		// get ready...
-    image_loop(opt_skip,
-	       total_sectors,starting_direction,
-	       opt_readsectors,opt_error_mode); // start the process
+    smap = new sector_map(total_sectors*sector_size);
+    if(opt_append){
+	/* Hashes the image up to the checkpoint, so before th is started */
+	opt_skip = resume() / sector_size;
+    }
+    last_checkpoint = time(0);
+    if(opt_multithreaded && !hash_invalid){
+	th = new threaded_hash(&th_md5,&th_sha1,&th_sha256);
+    }
+    if(opt_readsectors_auto && total_sectors>0){
+	if(opt_io_uring>0){
+	    /* io_uring splits every read into pieces of its own size */
+	    fprintf(stderr,"-R auto is ignored with --io_uring\n");
+	}
+	else {
+	    int max_sectors = opt_readsectors;
+	    if(max_sectors > (int)maxreadblocks && maxreadblocks>0) max_sectors = maxreadblocks;
+	    tuner = new chunk_tuner(max_sectors,sector_size);
+	}
+    }
+    if(opt_auto_compress && af){
+	ac = new auto_compress();
+    }
+    if(total_sectors>0) slow_read_ms = opt_slow_read;
+    if(opt_compress_threads>0){
+	/* Signing needs afflib to see each page as it is written,
+	 * and -e2 writes pages out of order.
+	 */
+	if(compress_pipeline::usable(af) && !opt_sign_key_file && !multipass){
+	    cp = new compress_pipeline(af,opt_compress_threads,ac);
+	}
+	else if(opt_silent==0){
+	    fprintf(stderr,"Compressing pages as they are written; cannot use --compress_threads\n");
+	}
+    }
+    if(multipass){
+	recovery r(this,opt_readsectors,opt_pass_time);
+	r.run();
+    }
+    else {
+	image_loop(opt_skip,
+		   total_sectors,starting_direction,
+		   opt_readsectors,opt_error_mode); // start the process
+	if(deferred.size()) read_deferred();
+    }
+    if(opt_checkpoint>0) checkpoint(); // so that --append can tell this one is done
+    if(cp){
+	delete cp;		// writes the pages that are still pending
+	cp = 0;
+    }
+    else if(ac){
+	/* The last page may be partial; it is written when af is closed */
+	af_enable_compression(af,ac->decide() ? opt_compression_alg : AF_COMPRESSION_ALG_NONE,
+			      opt_compression_level);
+    }
     signal(SIGINT,0);		// unset the handler
 
 
@@ -761,10 +1269,17 @@ void imager::start_imaging2()
      *** Finished imaging
      ****************************************************************/
 
+    /* Wait for the hashing thread to catch up before reading the hashes */
+    if(th){
+	th->join();
+	delete th;
+	th = 0;
+    }
+
     /* Calculate the final MD5 and SHA1 */
     md5 = th_md5.final();
     sha1 = th_sha1.final();
-    sha256 = sha256.final();
+    sha256 = th_sha256.final();
 }
 
 
@@ -793,6 +1308,12 @@ int imager::start_imaging()
 
     if(opt_append){
 	/* Make sure that the AFF file is for this drive, and set it up */
+	int64 device_sectors = 0;
+	if(af_get_segq(af,AF_DEVICE_SECTORS,&device_sectors)==0 &&
+	   total_sectors>0 && (uint64)device_sectors!=total_sectors){
+	    errx(1,"%s was made from a drive with %" PRId64 " sectors; %s has %" PRIu64,
+		 outfile,(int64_t)device_sectors,infile,(uint64_t)total_sectors);
+	}
     }
     else {
 
@@ -840,6 +1361,25 @@ int imager::start_imaging()
 	fprintf(logfile,"outfile_aff=%s ",outfile);
 	fprintf(logfile,"\n");
     }
+    /* An image being appended to keeps the windows (and tree) it was started with */
+    uint64 window = window_hash::stored_window(af);
+    bool tree = opt_tree_hash || window_hash::tree_wanted(af);
+    if(window==0 && (opt_hash_window || tree || opt_verify_readback)){
+	window = opt_hash_window>0 ? opt_hash_window : af_get_pagesize(af);
+    }
+    if(window>0){
+	if(window % sector_size){
+	    errx(1,"--hash_window must be a multiple of the sector size (%d bytes)",sector_size);
+	}
+	int nthreads = opt_multithreaded ? std::thread::hardware_concurrency() : 0;
+	if(opt_multithreaded && nthreads<2) nthreads = 2;
+	wh = new window_hash(af,window,tree,nthreads);
+	if(opt_verify_readback){
+	    rb = new readback_verifier(outfile,window);
+	    wh->send_to(rb);
+	}
+    }
+
     if(in!=FD_IDENT){
 	imaging_timer.start();
 	if(opt_recover_scan){
@@ -854,6 +1394,18 @@ int imager::start_imaging()
 
     /* AFF Cleanup... */
     if(af){
+	if(wh) wh->finish();		// everything has been written by now
+	if(opt_recover_scan){
+	    /* Only the missing pages were read. The image has changed, so
+	     * its hashes no longer hold, and the counts and the time are
+	     * those of the imaging, which are left alone.
+	     */
+	    af_del_seg(af,AF_MD5);
+	    af_del_seg(af,AF_SHA1);
+	    af_del_seg(af,AF_SHA256);
+	    write_map();
+	    return 0;
+	}
 	if(hash_invalid==false){
 	    if(af_update_seg(af,AF_MD5,0,md5.final(),md5.SIZE)){
 		if(errno!=ENOTSUP) perror("Could not update AF_MD5");
@@ -868,6 +1420,7 @@ int imager::start_imaging()
 	else {
 	    af_del_seg(af,AF_MD5);	// because it is not valid
 	    af_del_seg(af,AF_SHA1);
+	    af_del_seg(af,AF_SHA256);
 	}
 	if(af_update_segq(af,AF_BADSECTORS, (int64)bad_sectors_read)){
 	    if(errno!=ENOTSUP) perror("Could not update AF_BADSECTORS");
@@ -875,6 +1428,13 @@ int imager::start_imaging()
 	if(af_update_segq(af,AF_BLANKSECTORS, (int64)total_blank_sectors)){
 	    if(errno!=ENOTSUP) perror("Could not update AF_BLANKSECTORS");
 	}
+	if(ac){
+	    if(af_update_segq(af,AIMAGE_AUTOCOMPRESS_COMPRESSED,(int64)ac->compressed()) ||
+	       af_update_segq(af,AIMAGE_AUTOCOMPRESS_STORED,(int64)ac->stored())){
+		if(errno!=ENOTSUP) perror("Could not update auto-compress segments");
+	    }
+	}
+	write_map();
 	unsigned long elapsed_seconds = (unsigned long)imaging_timer.elapsed_seconds();
 	if(af_update_seg(af,AF_ACQUISITION_SECONDS,elapsed_seconds,0,0)){
 	    if(errno!=ENOTSUP) perror("Could not update AF_ACQUISITION_SECONDS");
@@ -885,6 +1445,188 @@ int imager::start_imaging()
 
 
 
+/* Save the sector map in the AFF file and, with --mapfile, as a
+ * ddrescue mapfile. Called again if imaging is interrupted.
+ */
+void imager::write_map()
+{
+    if(!smap) return;
+    if(af){
+	std::string seg = smap->encode();
+	if(seg.size() > max_map_segment){
+	    warnx("the sector map is %zu bytes, too large to save in the image",seg.size());
+	}
+	else if(af_update_seg(af,AIMAGE_SECTOR_MAP,sector_size,(const u_char *)seg.data(),seg.size())){
+	    if(errno!=ENOTSUP) perror("Could not update " AIMAGE_SECTOR_MAP);
+	}
+    }
+    if(opt_mapfile){
+	/* ddrescue's status for the -e2 pass we are in. Otherwise it is
+	 * finished only once nothing is left to read; a checkpoint or an
+	 * interrupt is still copying.
+	 */
+	static const char pass_status[] = "+??*/";
+	char current_status = pass_status[error_recovery_phase];
+	if(error_recovery_phase==0 &&
+	   (imaging || smap->bytes(sector_map::UNREAD) || smap->bytes(sector_map::NONTRIMMED) ||
+	    smap->bytes(sector_map::NONSCRAPED))){
+	    current_status = '?';
+	}
+	int  current_pass   = error_recovery_phase==2 ? 2 : 1;
+	if(smap->write_mapfile(opt_mapfile,write_pos,current_status,current_pass)){
+	    warn("%s",opt_mapfile);
+	}
+    }
+}
+
+
+/* Save what --append needs to carry on from here if the imaging is
+ * cut short: everything written so far is pushed out to the AFF file,
+ * then the AIMAGE_CHECKPOINT segment records where to pick up, the
+ * counters, and the hashes of the image up to that point. The sector
+ * map is saved alongside it.
+ */
+void imager::checkpoint()
+{
+    if(!af || !smap || sector_size==0) return;
+    if(th) th->drain();		// so that the generators are up to date
+    if(cp) cp->flush();
+    af_cache_flush(af);
+    write_map();
+
+    /* Pick up at the first sector that hasn't been read */
+    uint64_t resume_pos = smap->size();
+    uint64_t len = 0;
+    smap->find(sector_map::UNREAD,0,&resume_pos,&len);
+    if(resume_pos % sector_size || partial_sector_left) return; // the odd end of the input
+
+    char seg[1024];
+    size_t n = snprintf(seg,sizeof(seg),
+			"sector_size=%d\n"
+			"total_sectors=%" PRIu64 "\n"
+			"resume_pos=%" PRIu64 "\n"
+			"total_sectors_read=%" PRIu64 "\n"
+			"total_bytes_read=%" PRIu64 "\n"
+			"total_blank_sectors=%" PRIu64 "\n"
+			"bad_sectors_read=%" PRIu64 "\n",
+			sector_size,(uint64_t)total_sectors,resume_pos,
+			(uint64_t)total_sectors_read,(uint64_t)total_bytes_read,
+			(uint64_t)total_blank_sectors,(uint64_t)bad_sectors_read);
+
+    /* The hashes only carry over if they cover exactly what comes before resume_pos */
+    if(!hash_invalid && (uint64_t)th_md5.hashed_bytes==resume_pos){
+	n += snprintf(seg+n,sizeof(seg)-n,"md5=%s\nsha1=%s\nsha256=%s\n",
+		      th_md5.peek().hexdigest().c_str(),
+		      th_sha1.peek().hexdigest().c_str(),
+		      th_sha256.peek().hexdigest().c_str());
+    }
+    if(af_update_seg(af,AIMAGE_CHECKPOINT,0,(const u_char *)seg,n)){
+	if(errno!=ENOTSUP) perror("Could not update " AIMAGE_CHECKPOINT);
+    }
+}
+
+void imager::checkpoint_if_due()
+{
+    if(opt_checkpoint<=0) return;
+    time_t now = time(0);
+    if(now - last_checkpoint < opt_checkpoint) return;
+    checkpoint();
+    last_checkpoint = now;
+}
+
+/* The value of name in a checkpoint, or "" */
+static std::string checkpoint_value(const std::string &seg,const char *name)
+{
+    std::string key = std::string(name) + "=";
+    size_t pos = 0;
+    while(pos<seg.size()){
+	size_t eol = seg.find('\n',pos);
+	if(eol==std::string::npos) eol = seg.size();
+	if(seg.compare(pos,key.size(),key)==0){
+	    return seg.substr(pos+key.size(),eol-pos-key.size());
+	}
+	pos = eol+1;
+    }
+    return std::string();
+}
+
+/* For --append: restore the counters and the sector map from the last
+ * checkpoint and return where reading should pick up, in bytes.
+ * OpenSSL can't save a digest in the middle, so the hashes are brought
+ * back up to the checkpoint by hashing the image written so far again;
+ * that they come out as recorded shows that the image is intact.
+ */
+uint64 imager::resume()
+{
+    size_t len = 0;
+    if(af_get_seg(af,AIMAGE_CHECKPOINT,0,0,&len)){
+	errx(1,"%s: no checkpoint to pick up from",outfile);
+    }
+    std::string seg(len,'\0');
+    if(af_get_seg(af,AIMAGE_CHECKPOINT,0,(u_char *)&seg[0],&len)){
+	errx(1,"%s: cannot read " AIMAGE_CHECKPOINT,outfile);
+    }
+    if(total_sectors==0){
+	errx(1,"--append needs to know the size of %s",infile);
+    }
+    if(atoi(checkpoint_value(seg,"sector_size").c_str())!=sector_size ||
+       strtoull(checkpoint_value(seg,"total_sectors").c_str(),0,10)!=total_sectors){
+	errx(1,"%s was checkpointed imaging a different drive",outfile);
+    }
+    uint64 resume_pos   = strtoull(checkpoint_value(seg,"resume_pos").c_str(),0,10);
+    total_sectors_read  = strtoull(checkpoint_value(seg,"total_sectors_read").c_str(),0,10);
+    total_bytes_read    = strtoull(checkpoint_value(seg,"total_bytes_read").c_str(),0,10);
+    total_blank_sectors = strtoull(checkpoint_value(seg,"total_blank_sectors").c_str(),0,10);
+    bad_sectors_read    = strtoull(checkpoint_value(seg,"bad_sectors_read").c_str(),0,10);
+    total_bytes_written = resume_pos;
+    write_pos = resume_pos;
+
+    /* The map may be newer than the checkpoint if the imaging was interrupted */
+    uint32_t arg = 0;
+    len = 0;
+    bool have_map = false;
+    if(af_get_seg(af,AIMAGE_SECTOR_MAP,&arg,0,&len)==0 && (int)arg==sector_size){
+	std::vector<unsigned char> map(len);
+	have_map = af_get_seg(af,AIMAGE_SECTOR_MAP,0,map.data(),&len)==0 &&
+	    smap->decode(map.data(),len);
+    }
+    if(!have_map){
+	smap->mark(0,resume_pos,sector_map::GOOD);
+    }
+
+    std::string md5_hex = checkpoint_value(seg,"md5");
+    if(hash_invalid || md5_hex.size()==0){
+	hash_invalid = true;		// the image was not read in order
+	return resume_pos;
+    }
+
+    if(opt_silent==0){
+	fprintf(stderr,"Checking the first %" PRIu64 " bytes of %s against its checkpoint...\n",
+		(uint64_t)resume_pos,outfile);
+    }
+    int chunk = af_get_pagesize(af);
+    if(chunk<=0) chunk = opt_pagesize;
+    std::vector<unsigned char> page(chunk);
+    af_seek(af,0,SEEK_SET);
+    for(uint64 pos=0;pos<resume_pos;){
+	int want = resume_pos-pos < (uint64)chunk ? (int)(resume_pos-pos) : chunk;
+	if(af_read(af,page.data(),want)!=want){
+	    errx(1,"%s: cannot read back the image up to its checkpoint",outfile);
+	}
+	th_md5.update(page.data(),want);
+	th_sha1.update(page.data(),want);
+	th_sha256.update(page.data(),want);
+	pos += want;
+    }
+    if(th_md5.peek().hexdigest()!=md5_hex ||
+       th_sha1.peek().hexdigest()!=checkpoint_value(seg,"sha1") ||
+       th_sha256.peek().hexdigest()!=checkpoint_value(seg,"sha256")){
+	errx(1,"%s: the image does not match its checkpoint",outfile);
+    }
+    return resume_pos;
+}
+
+
 /* Listen for a local socket connection and return the
  * file descriptor...
  */
@@ -943,6 +1685,54 @@ void imager::final_report()
 
     printf("  Bytes read: %s\n", af_commas(buf,total_bytes_read));
     printf("  Bytes written: %s\n", af_commas(buf,callback_bytes_written));
+    double seconds = imaging_timer.elapsed_seconds();
+    if(seconds>0){
+	printf("  Read rate: %.1f MB/s (%s)\n",
+	       total_bytes_read / seconds / 1000000.0,
+	       direct_io ? "direct I/O" : "buffered I/O");
+    }
+    if(ac){
+	printf("  Auto compress: %" PRIu64 " pages compressed, %" PRIu64 " stored uncompressed\n",
+	       ac->compressed(),ac->stored());
+    }
+    if(smap){
+	uint64 unread = smap->bytes(sector_map::UNREAD) + smap->bytes(sector_map::NONTRIMMED)
+	    + smap->bytes(sector_map::NONSCRAPED);
+	if(smap->bytes(sector_map::BAD) || unread){
+	    printf("  Sector map: %s bytes bad, ",af_commas(buf,smap->bytes(sector_map::BAD)));
+	    printf("%s bytes unread\n",af_commas(buf,unread));
+	}
+    }
+    if(deferred.size()){
+	uint64 sectors = 0;
+	for(size_t i=0;i<deferred.size();i++){
+	    sectors += deferred[i].second - deferred[i].first;
+	}
+	printf("  Slow reads: %d region%s (%s sectors) put off for later\n",
+	       (int)deferred.size(),deferred.size()==1 ? "" : "s",af_commas(buf,sectors));
+    }
+    if(wh){
+	printf("  Window hashes: %" PRIu64 " SHA256s of %s-byte windows\n",
+	       wh->windows_hashed(),af_commas(buf,wh->window()));
+    }
+    if(rb){
+	printf("  Read back: %" PRIu64 " windows verified, %" PRIu64 " of them while imaging\n",
+	       rb->checked(),rb->checked_while_imaging());
+    }
+    if(bisect_reads){
+	printf("  Error isolation: %" PRIu64 " reads in %.1f seconds\n",
+	       bisect_reads,bisect_timer.elapsed_seconds());
+    }
+    if(tuner){
+	if(tuner->probing()){
+	    printf("  Read size: %d sectors (still probing when imaging finished)\n",
+		   tuner->sectors());
+	}
+	else {
+	    printf("  Read size: %d sectors (chosen automatically; probed %d time%s)\n",
+		   tuner->sectors(),tuner->probes(),tuner->probes()==1 ? "" : "s");
+	}
+    }
 
     char print_buf[256];
     printf("\n");
@@ -954,6 +1744,11 @@ void imager::final_report()
 	printf("raw image sha256: %s\n",
 	       af_hexbuf(print_buf,sizeof(print_buf),sha256.final(),sha256.SIZE,opt_hexbuf));
     }
+    if(wh && wh->tree_valid()){
+	printf("raw image tree sha256: %s\n",
+	       af_hexbuf(print_buf,sizeof(print_buf),wh->tree_root().final(),
+			 wh->tree_root().SIZE,opt_hexbuf));
+    }
 
     if(imaging_failed){
 	printf("\nTHIS DRIVE COULD NOT BE IMAGED DUE TO A HARDWARE FAILURE.\n");
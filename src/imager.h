@@ -1,5 +1,6 @@
 #include <afflib/aftimer.h>
 #include "hash_t.h"
+#include <vector>
 
 class imager {
 public:
@@ -51,6 +52,10 @@ public:
     /* Input Device parameters */
     int		in;			// input fd
     uint64	in_pos;			// current position, or -1 if unknown
+    class input_source *src;		// what everything is read through
+    bool	direct_io;		// in was opened with O_DIRECT
+    int		in_buffered;		// buffered fd for reads O_DIRECT can't do
+    int		io_align;		// O_DIRECT offset and length alignment
     int		sector_size;		// in bytes; 0 if unknown
     uint64	total_sectors;	      // in sectors; 0 if uncomputable
     unsigned int maxreadblocks;		// in bytes; that can be read
@@ -67,6 +72,14 @@ public:
     sha1_t		sha1;
     sha256_generator th_sha256;
     sha256_t		sha256;
+    class threaded_hash *th;		// hashing thread, if running multithreaded
+    class chunk_tuner *tuner;		// picks the read size with -R auto
+    class compress_pipeline *cp;	// compresses pages on other threads
+    class auto_compress *ac;		// per-page compression decisions for -A
+    class sector_map *smap;		// what has been read where
+    class window_hash *wh;		// per-window SHA256s, with --hash_window
+    class readback_verifier *rb;	// checks the windows as they are written, or 0
+    uint64	write_pos;		// where the next write_data() goes, in bytes
 
     bool	hash_invalid;		// did we reverse direction or skip?
     uint64	last_sector_read ;	// sector number last read
@@ -78,17 +91,28 @@ public:
 
     unsigned char *buf;			// the transfer buffer
     unsigned int bufsize;		// how many bytes in buf
-    char  blank_sector[512];		// a lot of zeros
     int   partial_sector_left;		
     bool  partial_sector_blank;
+    uint64 blank_start;			// the run of blank sectors going into smap
+    uint64 blank_len;			// in bytes; 0 for none
 
     /* Error handling */
     uint64 bad_sectors_read;
     int    consecutive_read_errors;
     int	   consecutive_read_error_regions;
-    int    error_recovery_phase;
+    int    error_recovery_phase;		// -e2 pass, or 0
+    uint64 bisect_reads;		// reads made by isolate_errors()
+    aftimer bisect_timer;		// and the time they took
+
+    /* Slow-read watchdog */
+    int    slow_read_ms;		// defer the region after a read this slow; 0 for off
+    std::vector<std::pair<uint64,uint64> > deferred; // sectors [first,second) put off
+    class fault_profile *faults;	// --simulate_faults, or 0
     int    last_direction;			// 1 = forwards, -1 = backwards
 
+    /* Checkpoints for --append */
+    time_t last_checkpoint;		// when the last one was written
+
     /****************************************************************/
 
 
@@ -97,6 +121,7 @@ public:
 
     /* Setup functions */
     int  open_dev(const char *friendly_name);
+    int  open_input(const char *name);
     int  set_input_fd(int ifd);
     void hash_setup();
     int set_input(const char *name);
@@ -105,6 +130,20 @@ public:
 
     /* Imaging data */
     void write_data(unsigned char *buf,uint64 offset,int bytes_read);
+    int  write_auto(unsigned char *buf,int len);
+    void get_badflag();
+    void free_badflag();
+    void fill_badflag(unsigned char *buf,int from,int to);
+    int  read_input(unsigned char *buf,uint64 offset,int len); // pread, out of order
+    void isolate_errors(unsigned char *buf,uint64 offset,int len,std::vector<uint64> &bad);
+    void simulate_slow_read(uint64 offset,int len);	// for -d98
+    void read_deferred();		// go back for what the watchdog put off
+    void map_blank(uint64 pos,uint64 len);
+    void map_blank_sectors(uint64 pos,const unsigned char *buf,int nsectors);
+    void write_map();			// save smap to the AFF and the mapfile
+    void checkpoint();			// save what --append needs to pick up from here
+    void checkpoint_if_due();		// every opt_checkpoint seconds
+    uint64 resume();			// restore the last checkpoint; returns where to read from
     void image_loop(uint64 low_water_mark,
 			uint64 high_water_mark,
 			int direction, int readsectors,int error_mask);
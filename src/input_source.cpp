@@ -0,0 +1,242 @@
+/*
+ * input_source.cpp:
+ * The devices, files and sockets the imager reads, and the simulated
+ * drive used for testing.
+ */
+
+#include "config.h"
+#include "input_source.h"
+#include "fault_profile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string>
+
+/****************************************************************
+ *** fd_source
+ ****************************************************************/
+
+fd_source::fd_source(int fd_,int buffered_fd,int io_align_):
+    in(fd_),buffered(buffered_fd),io_align(io_align_),pos(0),seek_needed(false)
+{
+}
+
+int fd_source::read(unsigned char *buf,int len)
+{
+    int got;
+    if(unaligned(pos,len)){
+	got = ::pread(buffered,buf,len,pos); // O_DIRECT can't do this read
+	seek_needed = true;
+    }
+    else {
+	if(seek_needed){
+	    lseek(in,pos,SEEK_SET);
+	    seek_needed = false;
+	}
+	got = ::read(in,buf,len);
+	if(got<0 && errno==EINVAL && buffered>=0){
+	    /* O_DIRECT refused it after all; try it buffered */
+	    got = ::pread(buffered,buf,len,pos);
+	}
+    }
+    if(got>0) pos += got;
+    return got;
+}
+
+int fd_source::pread(unsigned char *buf,int len,uint64_t offset)
+{
+    if(unaligned(offset,len)) return ::pread(buffered,buf,len,offset);
+    int got = ::pread(in,buf,len,offset);
+    if(got<0 && errno==EINVAL && buffered>=0){
+	got = ::pread(buffered,buf,len,offset);
+    }
+    return got;
+}
+
+int fd_source::seek(uint64_t offset)
+{
+    if(lseek(in,offset,SEEK_SET)<0) return -1;
+    pos = offset;
+    seek_needed = false;
+    return 0;
+}
+
+/****************************************************************
+ *** sim_source
+ ****************************************************************/
+
+static const int SIM_BLOCK = 512;	// the data is made this much at a time
+
+sim_source::sim_source():
+    bytes(64*1024*1024),sector(512),latency_us(0),seek_us(0),rate(0),data(MIXED),
+    faults(0),pos(0),last_end(0)
+{
+}
+
+sim_source::~sim_source()
+{
+    delete faults;
+}
+
+/* n, nK, nM or nG */
+static bool parse_size(const char *str,uint64_t *val)
+{
+    char *end = 0;
+    *val = strtoull(str,&end,10);
+    switch(*end){
+    case 'k': case 'K': *val <<= 10; end++; break;
+    case 'm': case 'M': *val <<= 20; end++; break;
+    case 'g': case 'G': *val <<= 30; end++; break;
+    }
+    return end!=str && *end==0;
+}
+
+sim_source *sim_source::open(const char *spec)
+{
+    sim_source *s = new sim_source();
+    const char *faults_spec = 0;
+    bool ok = true;
+    while(*spec && ok){
+	if(strncmp(spec,"faults=",7)==0){
+	    faults_spec = spec+7;	// the rest is the profile
+	    break;
+	}
+	const char *comma = strchr(spec,',');
+	std::string item(spec,comma ? comma-spec : strlen(spec));
+	spec += item.size();
+	if(*spec==',') spec++;
+
+	size_t eq = item.find('=');
+	if(eq==std::string::npos){
+	    ok = false;
+	    break;
+	}
+	std::string key = item.substr(0,eq);
+	const char *val = item.c_str()+eq+1;
+	uint64_t n = 0;
+	if(key=="data"){
+	    if(strcmp(val,"zero")==0) s->data = ZERO;
+	    else if(strcmp(val,"random")==0) s->data = RANDOM;
+	    else if(strcmp(val,"text")==0) s->data = TEXT;
+	    else if(strcmp(val,"mixed")==0) s->data = MIXED;
+	    else ok = false;
+	}
+	else if(!parse_size(val,&n)) ok = false;
+	else if(key=="size") s->bytes = n;
+	else if(key=="sector") s->sector = (int)n;
+	else if(key=="latency") s->latency_us = (int)n;
+	else if(key=="seek") s->seek_us = (int)n;
+	else if(key=="rate") s->rate = (int)n;
+	else ok = false;
+    }
+    if(ok && (s->sector<=0 || s->sector % SIM_BLOCK != 0 || s->bytes==0)) ok = false;
+    if(ok && faults_spec){
+	s->faults = new fault_profile();
+	ok = s->faults->parse(faults_spec,s->sector);
+    }
+    if(!ok){
+	delete s;
+	return 0;
+    }
+    return s;
+}
+
+static uint64_t mix(uint64_t x)		// splitmix64
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x>>30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x>>27)) * 0x94d049bb133111ebULL;
+    return x ^ (x>>31);
+}
+
+void sim_source::fill_block(unsigned char *block,uint64_t n) const
+{
+    static const char *words[16] = {
+	"the","of","and","to","a","in","is","that",
+	"drive","sector","image","file","data","for","with","page"
+    };
+    data_kind kind = data;
+    if(kind==MIXED){
+	kind = (data_kind)(mix(n >> 11) % 3); // the same for each 1MB
+    }
+    uint64_t r = mix(n);
+    switch(kind){
+    case ZERO:
+    case MIXED:
+	memset(block,0,SIM_BLOCK);
+	break;
+    case RANDOM:
+	for(int i=0;i<SIM_BLOCK;i+=8){
+	    r = mix(r);
+	    memcpy(block+i,&r,8);
+	}
+	break;
+    case TEXT:
+	for(int i=0;i<SIM_BLOCK;){
+	    r = mix(r);
+	    for(int w=0;w<8 && i<SIM_BLOCK;w++){
+		unsigned int bits = (r >> (w*8)) & 0xff;
+		for(const char *cc=words[bits & 15];*cc && i<SIM_BLOCK;cc++){
+		    block[i++] = *cc;
+		}
+		if(i<SIM_BLOCK) block[i++] = (bits>>4)==0 ? '\n' : ' ';
+	    }
+	}
+	break;
+    }
+}
+
+void sim_source::fill(unsigned char *buf,uint64_t offset,int len) const
+{
+    unsigned char block[SIM_BLOCK];
+    while(len>0){
+	uint64_t n   = offset / SIM_BLOCK;
+	int      off = offset % SIM_BLOCK;
+	int      count = SIM_BLOCK-off < len ? SIM_BLOCK-off : len;
+	if(off==0 && count==SIM_BLOCK){
+	    fill_block(buf,n);
+	}
+	else {
+	    fill_block(block,n);
+	    memcpy(buf,block+off,count);
+	}
+	buf    += count;
+	offset += count;
+	len    -= count;
+    }
+}
+
+int sim_source::pread(unsigned char *buf,int len,uint64_t offset)
+{
+    if(offset>=bytes) return 0;
+    if(offset+len > bytes) len = bytes-offset;
+
+    uint64_t us = latency_us;
+    if(offset!=last_end) us += seek_us;
+    if(rate>0) us += (uint64_t)len / rate; // bytes at MB/s, in us
+    if(us) usleep(us);
+    last_end = offset+len;
+
+    if(faults && faults->fail(offset,len)){
+	errno = EIO;
+	return -1;
+    }
+    fill(buf,offset,len);
+    return len;
+}
+
+int sim_source::read(unsigned char *buf,int len)
+{
+    int got = pread(buf,len,pos);
+    if(got>0) pos += got;
+    return got;
+}
+
+int sim_source::seek(uint64_t offset)
+{
+    pos = offset;
+    return 0;
+}
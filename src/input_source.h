@@ -0,0 +1,97 @@
+/*
+ * input_source.h:
+ * Where the imager gets its data from. set_input() picks the source
+ * for the name it is given, and image_loop() and the code that reads
+ * out of order only ever read through it:
+ *
+ *  - fd_source: a device, file, socket or pipe. With --direct the
+ *    descriptor is opened O_DIRECT, and reads that O_DIRECT can't do
+ *    go to a second, buffered descriptor instead.
+ *  - sim_source: a simulated drive, "sim:" followed by a
+ *    comma-separated list of
+ *	size=n[KMG]	size in bytes (default 64M)
+ *	sector=n	sector size in bytes (default 512)
+ *	latency=us	time each read takes, in microseconds (default 0)
+ *	seek=us		added to a read that doesn't follow the last one
+ *	rate=MB/s	transfer rate; 0 for no limit (default 0)
+ *	data=k		zero, random, text or mixed (default mixed)
+ *	faults=p	a fault_profile (see fault_profile.h); it takes
+ *			the rest of the name, commas and all
+ *    for example "sim:size=1G,latency=200,rate=150,faults=bad:1000-1099".
+ *    The data depends only on where it is, so every read of a sector
+ *    gives the same bytes and images of the same drive are the same.
+ *
+ * read() reads from the current position and moves it, like read(2);
+ * pread() reads from anywhere and leaves it alone, like pread(2).
+ * Both return the number of bytes read, or -1 with errno set. Only
+ * read() works on a source that can't seek, such as a socket.
+ * fd() is the descriptor behind the source, for the reader thread,
+ * or -1 if there isn't one; then the imager does all of the reading.
+ */
+
+#ifndef INPUT_SOURCE_H
+#define INPUT_SOURCE_H
+
+#include <stdint.h>
+
+class input_source {
+public:
+    virtual ~input_source(){}
+    virtual int  read(unsigned char *buf,int len)=0;
+    virtual int  pread(unsigned char *buf,int len,uint64_t offset)=0;
+    virtual int  seek(uint64_t offset)=0; // 0, or -1 if the source can't
+    virtual int  fd() const { return -1; }
+};
+
+class fd_source: public input_source {
+public:
+    /* buffered_fd and io_align are only for O_DIRECT; -1 and 0 otherwise */
+    fd_source(int fd,int buffered_fd=-1,int io_align=0);
+    int  read(unsigned char *buf,int len);
+    int  pread(unsigned char *buf,int len,uint64_t offset);
+    int  seek(uint64_t offset);
+    int  fd() const { return in; }
+
+private:
+    bool unaligned(uint64_t offset,int len) const {
+	return buffered>=0 && io_align>0 && (offset % io_align != 0 || len % io_align != 0);
+    }
+    int      in;
+    int      buffered;
+    int      io_align;
+    uint64_t pos;			// where in is, if it can seek
+    bool     seek_needed;		// a read went to buffered; put in at pos
+};
+
+class sim_source: public input_source {
+public:
+    static sim_source *open(const char *spec); // the part after "sim:"; 0 if malformed
+    ~sim_source();
+    int  read(unsigned char *buf,int len);
+    int  pread(unsigned char *buf,int len,uint64_t offset);
+    int  seek(uint64_t offset);
+
+    uint64_t size() const { return bytes; }
+    int  sector_size() const { return sector; }
+
+private:
+    sim_source();
+    sim_source(const sim_source &);		// not implemented
+    sim_source &operator=(const sim_source &);	// not implemented
+    void fill(unsigned char *buf,uint64_t offset,int len) const;
+    void fill_block(unsigned char *block,uint64_t n) const; // the nth 512 bytes
+
+    enum data_kind { ZERO, RANDOM, TEXT, MIXED };
+
+    uint64_t bytes;
+    int      sector;
+    int      latency_us;
+    int      seek_us;
+    int      rate;			// MB/s
+    data_kind data;
+    class fault_profile *faults;
+    uint64_t pos;			// for read()
+    uint64_t last_end;			// where the last read stopped, for seek_us
+};
+
+#endif
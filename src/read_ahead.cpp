@@ -0,0 +1,301 @@
+/*
+ * read_ahead.cpp:
+ * The reader thread used by imager::image_loop.
+ */
+
+#include "config.h"
+#include "read_ahead.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+#include <algorithm>
+#include <chrono>
+
+read_ahead::read_ahead(int fd_,int nbufs,int bufsize,
+		       int sector_size_,int queue_depth_):
+    fd(fd_),unaligned_fd(-1),align(0),sector_size(sector_size_),
+    queue_depth(queue_depth_),uring(false),
+    blocks(),freelist(),inflight(),ready(),pieces_in_flight(0),last_done(),discarding(false),
+    next_offset(0),end(0),chunk(0),running(false),finished(false),
+    M(),changed(),thread()
+{
+#ifdef HAVE_LIBURING
+    if(queue_depth>0){
+	int ret = io_uring_queue_init(queue_depth,&ring,0);
+	if(ret==0){
+	    uring = true;
+	    /* Make sure there are enough blocks to keep the queue full */
+	    int pieces_per_block = (bufsize + URING_PIECE_SIZE - 1) / URING_PIECE_SIZE;
+	    int needed = (queue_depth + pieces_per_block - 1) / pieces_per_block + 1;
+	    if(nbufs < needed) nbufs = needed;
+	}
+	else {
+	    fprintf(stderr,"io_uring not available (%s); reading with pread.\n",strerror(-ret));
+	}
+    }
+#endif
+    if(nbufs<1) nbufs = 1;		// -r0 with --io_uring and no io_uring
+    blocks.resize(nbufs);
+    for(int i=0;i<nbufs;i++){
+	if(posix_memalign((void **)&blocks[i].buf,4096,bufsize)) err(1,"posix_memalign");
+	freelist.push_back(&blocks[i]);
+    }
+#ifdef HAVE_LIBURING
+    if(uring){
+	thread = std::thread(&read_ahead::run_uring,this);
+	return;
+    }
+#endif
+    thread = std::thread(&read_ahead::run,this);
+}
+
+read_ahead::~read_ahead()
+{
+    {
+	std::lock_guard<std::mutex> lock(M);
+	running  = false;
+	finished = true;
+	changed.notify_all();
+    }
+    thread.join();
+#ifdef HAVE_LIBURING
+    if(uring) io_uring_queue_exit(&ring);
+#endif
+    for(size_t i=0;i<blocks.size();i++){
+	free(blocks[i].buf);
+    }
+}
+
+/* With O_DIRECT, reads must be aligned; anything that isn't is read from fd2 */
+void read_ahead::set_unaligned_fd(int fd2,int align_)
+{
+    std::lock_guard<std::mutex> lock(M);
+    unaligned_fd = fd2;
+    align        = align_;
+}
+
+int read_ahead::fd_for(const block *b) const
+{
+    if(unaligned_fd>=0 && align>0 && (b->offset % align != 0 || b->len % align != 0)){
+	return unaligned_fd;
+    }
+    return fd;
+}
+
+/* O_DIRECT can still refuse a read that fd_for() thought was aligned
+ * (a file system with a larger block size, say). Read b through the
+ * buffered fd instead.
+ */
+void read_ahead::retry_unaligned(block *b)
+{
+    if(unaligned_fd<0) return;
+    b->bytes_read = pread(unaligned_fd,b->buf,b->len,b->offset);
+    b->error      = b->bytes_read<0 ? errno : 0;
+}
+
+void read_ahead::start(uint64_t offset,uint64_t end_,int chunk_)
+{
+    stop();
+    std::lock_guard<std::mutex> lock(M);
+    next_offset = offset;
+    end         = end_;
+    chunk       = chunk_;
+    discarding  = false;
+    running     = (chunk>0 && next_offset<end && blocks.size()>0);
+    changed.notify_all();
+}
+
+/* Stop the reader, wait for any reads in progress, and throw away
+ * everything that has been read but not handed out.
+ */
+void read_ahead::stop()
+{
+    std::unique_lock<std::mutex> lock(M);
+    running = false;
+    changed.wait(lock,[this]{ return inflight.empty(); });
+    while(ready.size()){
+	freelist.push_back(ready.front());
+	ready.pop_front();
+    }
+    changed.notify_all();
+}
+
+bool read_ahead::active()
+{
+    std::lock_guard<std::mutex> lock(M);
+    return running || inflight.size() || ready.size();
+}
+
+read_ahead::block *read_ahead::get(uint64_t offset,int len)
+{
+    std::unique_lock<std::mutex> lock(M);
+    changed.wait(lock,[this]{ return ready.size()>0 || (inflight.empty() && !running); });
+    if(ready.empty()) return 0;		// reader has stopped
+    block *b = ready.front();
+    if(b->offset!=offset || b->len!=len) return 0; // not what we predicted
+    ready.pop_front();
+    return b;
+}
+
+void read_ahead::release(block *b)
+{
+    std::lock_guard<std::mutex> lock(M);
+    freelist.push_back(b);
+    changed.notify_all();
+}
+
+read_ahead::block *read_ahead::next_block()
+{
+    block *b = freelist.back();
+    freelist.pop_back();
+    b->offset = next_offset;
+    b->len    = chunk;
+    if((uint64_t)b->len > end-next_offset) b->len = (int)(end-next_offset);
+    b->bytes_read = 0;
+    b->error      = 0;
+    next_offset += b->len;
+    if(next_offset>=end) running = false;
+    inflight.push_back(b);
+    return b;
+}
+
+/* b has been read. Move every completed block at the front of
+ * inflight over to ready, so that they are handed out in order.
+ * Anything other than a complete read needs image_loop's attention,
+ * so after one of those, stop reading and drop whatever follows.
+ */
+void read_ahead::finish(block *b)
+{
+    b->pending = 0;
+    while(inflight.size() && inflight.front()->pending==0){
+	block *f = inflight.front();
+	inflight.pop_front();
+	if(discarding){
+	    freelist.push_back(f);
+	    continue;
+	}
+	ready.push_back(f);
+	if(f->bytes_read!=f->len){
+	    running    = false;
+	    discarding = true;
+	}
+    }
+    changed.notify_all();
+}
+
+void read_ahead::run()
+{
+    std::unique_lock<std::mutex> lock(M);
+    while(true){
+	changed.wait(lock,[this]{ return finished || (running && freelist.size()>0); });
+	if(finished) return;
+
+	block *b = next_block();
+	b->pending = 1;
+	lock.unlock();
+
+	std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+	b->bytes_read = pread(fd_for(b),b->buf,b->len,b->offset);
+	b->error      = b->bytes_read<0 ? errno : 0;
+	if(b->error==EINVAL) retry_unaligned(b);
+	b->seconds    = std::chrono::duration<double>(std::chrono::steady_clock::now()-t0).count();
+
+	lock.lock();
+	finish(b);
+    }
+}
+
+#ifdef HAVE_LIBURING
+void read_ahead::run_uring()
+{
+    int piece_size = URING_PIECE_SIZE - URING_PIECE_SIZE % sector_size;
+    std::unique_lock<std::mutex> lock(M);
+    while(true){
+	if(pieces_in_flight==0){
+	    changed.wait(lock,[this]{ return finished || (running && freelist.size()>0); });
+	    if(finished) return;
+	}
+
+	/* Submit reads for as many blocks as the queue has room for */
+	while(!finished && running && freelist.size()>0){
+	    int npieces = (chunk + piece_size - 1) / piece_size;
+	    if(pieces_in_flight>0 && pieces_in_flight + npieces > queue_depth) break;
+
+	    block *b = next_block();
+	    b->pieces.resize((b->len + piece_size - 1) / piece_size);
+	    b->pending = b->pieces.size();
+	    pieces_in_flight += b->pending;
+	    lock.unlock();
+
+	    int rfd = fd_for(b);
+	    b->submitted = std::chrono::steady_clock::now();
+	    for(size_t i=0;i<b->pieces.size();i++){
+		piece &p = b->pieces[i];
+		p.blk    = b;
+		p.offset = i * piece_size;
+		p.len    = b->len - p.offset < piece_size ? b->len - p.offset : piece_size;
+		p.res    = 0;
+		struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+		if(!sqe){			// submission queue is full
+		    io_uring_submit(&ring);
+		    sqe = io_uring_get_sqe(&ring);
+		    if(!sqe) errx(1,"read_ahead: cannot get io_uring sqe");
+		}
+		io_uring_prep_read(sqe,rfd,b->buf+p.offset,p.len,b->offset+p.offset);
+		io_uring_sqe_set_data(sqe,&p);
+	    }
+	    io_uring_submit(&ring);
+	    lock.lock();
+	}
+	if(pieces_in_flight==0) continue;
+
+	/* Wait for a read to complete */
+	lock.unlock();
+	struct io_uring_cqe *cqe = 0;
+	int ret = io_uring_wait_cqe(&ring,&cqe);
+	if(ret==-EINTR){
+	    lock.lock();
+	    continue;
+	}
+	if(ret<0) errx(1,"io_uring_wait_cqe: %s",strerror(-ret));
+	piece *p = (piece *)io_uring_cqe_get_data(cqe);
+	p->res = cqe->res;
+	io_uring_cqe_seen(&ring,cqe);
+	lock.lock();
+
+	pieces_in_flight--;
+	block *b = p->blk;
+	if(--b->pending>0) continue;
+
+	/* All of b is in. Like read(), report the bytes that were read
+	 * up to the first short piece, or the error if there were none.
+	 */
+	b->bytes_read = 0;
+	for(size_t i=0;i<b->pieces.size();i++){
+	    const piece &q = b->pieces[i];
+	    if(q.res<0){
+		if(b->bytes_read==0){
+		    b->bytes_read = -1;
+		    b->error      = -q.res;
+		}
+		break;
+	    }
+	    b->bytes_read += q.res;
+	    if(q.res!=q.len) break;
+	}
+	if(b->error==EINVAL){
+	    lock.unlock();
+	    retry_unaligned(b);
+	    lock.lock();
+	}
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	b->seconds = std::chrono::duration<double>(now - std::max(b->submitted,last_done)).count();
+	last_done  = now;
+	finish(b);
+    }
+}
+#endif
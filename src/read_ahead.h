@@ -0,0 +1,129 @@
+/*
+ * read_ahead.h:
+ * A reader thread that keeps a ring of buffers filled with the
+ * sectors that image_loop is going to ask for next, so that the
+ * drive keeps reading while we hash, compress and write.
+ *
+ * The reader only predicts the simple case: reading forward, one
+ * chunk after another. image_loop asks for each read with get(); if
+ * the next block in the ring is not for exactly that offset and
+ * length (because of an error, a skip, or a change of direction),
+ * get() returns 0 and image_loop does the read itself, exactly as it
+ * would without read-ahead. The reader stops at the first short or
+ * failed read and is restarted with start() once image_loop is
+ * reading forward again.
+ *
+ * If queue_depth>0 and aimage was built with liburing, the reader
+ * splits each block into sector-aligned pieces and uses io_uring to
+ * keep queue_depth of them in flight at once. Blocks are still
+ * handed to image_loop in order, and a block with a short or failed
+ * piece looks to image_loop just like a short or failed read().
+ * Past bytes_read, a block's buffer holds whatever was there before;
+ * image_loop fills in the bad flag only where it needs it.
+ *
+ * A block's seconds is how long the read took, for the --slow_read
+ * watchdog (and -R auto, which isn't used with io_uring). With
+ * io_uring, blocks overlap, so a block is timed from when it was
+ * submitted or when the block before it completed, whichever was
+ * later. Time spent queued behind other blocks then isn't taken for a
+ * slow read, and a read that stalls still shows as slow.
+ */
+
+#ifndef READ_AHEAD_H
+#define READ_AHEAD_H
+
+#include <stdint.h>
+#include <vector>
+#include <deque>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+class read_ahead {
+public:
+    static const int URING_PIECE_SIZE = 1024*1024; // bytes per io_uring read
+
+    class block;
+    class piece {			// one io_uring read
+    public:
+	piece():blk(0),offset(0),len(0),res(0){}
+	block *blk;
+	int   offset;			// within the block
+	int   len;
+	int   res;			// what the read returned
+    };
+
+    class block {
+    public:
+	block():buf(0),offset(0),len(0),bytes_read(0),error(0),seconds(0),pieces(),pending(0),
+		submitted(){}
+	unsigned char *buf;
+	uint64_t offset;		// where in the input it was read from
+	int      len;			// bytes requested
+	int      bytes_read;		// what read returned
+	int      error;			// errno if bytes_read<0
+	double   seconds;		// how long the read took
+	std::vector<piece> pieces;	// io_uring reads that make up the block
+	int      pending;		// pieces not yet completed
+	std::chrono::steady_clock::time_point submitted; // when its io_uring reads went in
+    };
+
+    read_ahead(int fd,int nbufs,int bufsize,int sector_size,
+	       int queue_depth=0);
+    ~read_ahead();
+
+    void start(uint64_t offset,uint64_t end,int chunk); // read [offset,end) in chunk-sized pieces
+    void stop();			// stop reading and discard anything read
+    bool active();			// true if started and not stopped
+    bool using_uring() const { return uring; }
+    void set_unaligned_fd(int fd2,int align); // fd to use for reads not aligned to align
+
+    block *get(uint64_t offset,int len); // the block for this read, or 0
+    void release(block *b);		// done with the block from get()
+
+private:
+    read_ahead(const read_ahead &);		// not implemented
+    read_ahead &operator=(const read_ahead &);	// not implemented
+
+    block *next_block();		// set up the next block to read; M must be held
+    int  fd_for(const block *b) const; // which fd to read b with
+    void retry_unaligned(block *b);	// read b again through unaligned_fd
+    void finish(block *b);		// hand b (and whatever follows) over; M must be held
+    void run();				// read with pread, one block at a time
+#ifdef HAVE_LIBURING
+    void run_uring();			// read with io_uring
+    struct io_uring ring;
+#endif
+
+    int fd;
+    int unaligned_fd;			// for O_DIRECT; reads not aligned to align
+    int align;
+    int sector_size;
+    int queue_depth;
+    bool uring;				// reading with io_uring
+
+    std::vector<block> blocks;
+    std::vector<block *> freelist;	// blocks available for reading
+    std::deque<block *> inflight;	// blocks being read, in order
+    std::deque<block *> ready;		// blocks that have been read, in order
+    int      pieces_in_flight;		// io_uring reads submitted and not completed
+    std::chrono::steady_clock::time_point last_done; // when the last io_uring block completed
+    bool     discarding;		// a short read was handed over; drop what follows
+
+    uint64_t next_offset;		// where the next read will be
+    uint64_t end;			// where to stop
+    int      chunk;			// bytes per read
+    bool     running;			// reader should keep reading
+    bool     finished;			// reader should exit
+
+    std::mutex M;
+    std::condition_variable changed;	// signaled on any state change
+    std::thread thread;
+};
+
+#endif
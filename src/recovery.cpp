@@ -0,0 +1,212 @@
+/*
+ * recovery.cpp:
+ * The copy, trim and scrape passes of -e2.
+ */
+
+#include "config.h"
+#include "aimage.h"
+#include "imager.h"
+#include "sector_map.h"
+#include "recovery.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <err.h>
+
+recovery::recovery(imager *im_,int readsectors,int pass_seconds_):
+    im(im_),buf(0),chunk(0),sector_size(im_->sector_size),
+    pass_seconds(pass_seconds_),pass_start(),read_seconds(0)
+{
+    if(readsectors > (int)im->maxreadblocks && im->maxreadblocks>0) readsectors = im->maxreadblocks;
+    chunk = readsectors * sector_size;
+    void *p = 0;
+    if(posix_memalign(&p,4096,chunk)) err(1,"malloc");
+    buf = (unsigned char *)p;
+}
+
+recovery::~recovery()
+{
+    free(buf);
+}
+
+void recovery::run()
+{
+    im->get_badflag();
+    start_pass(1);
+    copy_pass(true);
+    start_pass(2);
+    copy_pass(false);
+    start_pass(3);
+    trim_pass();
+    start_pass(4);
+    scrape_pass();
+    give_up();
+    im->error_recovery_phase = 0;	// finished
+    im->free_badflag();
+}
+
+void recovery::start_pass(int pass)
+{
+    im->error_recovery_phase = pass;
+    pass_start = std::chrono::steady_clock::now();
+}
+
+bool recovery::out_of_time()
+{
+    if(pass_seconds<=0) return false;
+    return std::chrono::steady_clock::now() - pass_start > std::chrono::seconds(pass_seconds);
+}
+
+int recovery::read(uint64_t pos,int len)
+{
+    im->checkpoint_if_due();		// between reads, the map is up to date
+    im->last_sector_read  = pos / sector_size;
+    im->last_sectors_read = len / sector_size;
+    im->last_direction    = 1;
+    im->status();
+
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    int got = im->read_input(buf,pos,len);
+    read_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-t0).count();
+    if(got>0){
+	im->total_bytes_read   += got;
+	im->total_sectors_read += got / sector_size;
+    }
+    return got;
+}
+
+void recovery::write(uint64_t pos,int len)
+{
+    im->write_data(buf,pos,len);
+}
+
+void recovery::write_bad(uint64_t pos,int len)
+{
+    for(int i=0;i<len;i+=sector_size){
+	memcpy(buf+i,im->badflag,sector_size);
+    }
+    write(pos,len);
+    im->smap->mark(pos,len,sector_map::BAD);
+    im->bad_sectors_read += len / sector_size;
+}
+
+bool recovery::read_sector(uint64_t pos)
+{
+    if(read(pos,sector_size)==sector_size){
+	write(pos,sector_size);
+	return true;
+    }
+    write_bad(pos,sector_size);
+    return false;
+}
+
+void recovery::copy_pass(bool skipping)
+{
+    sector_map *map = im->smap;
+    uint64_t max_skip = map->size() / 100;
+    max_skip -= max_skip % sector_size;
+    if(max_skip<MIN_SKIP) max_skip = MIN_SKIP;
+    uint64_t skip = MIN_SKIP;
+
+    uint64_t pos = 0;
+    uint64_t len = 0;
+    while(!out_of_time() && map->find(sector_map::UNREAD,pos,&pos,&len)){
+	int n = len < (uint64_t)chunk ? (int)len : chunk;
+	int got = read(pos,n);
+	if(got==n){
+	    write(pos,n);
+	    pos += n;
+	    if(skipping && im->slow_read_ms>0 && read_seconds*1000 > im->slow_read_ms){
+		/* The drive is struggling here; leave what follows for pass 2 */
+		uint64_t end = pos+skip < map->size() ? pos+skip : map->size();
+		im->hash_invalid = true;
+		pos = end;
+		skip *= 2;
+		if(skip>max_skip) skip = max_skip;
+	    }
+	    else {
+		skip = MIN_SKIP;
+	    }
+	    continue;
+	}
+
+	/* Keep the whole sectors that were read; the rest is for trimming */
+	int good = got>0 ? got - got % sector_size : 0;
+	if(good>0) write(pos,good);
+	map->mark(pos+good,n-good,sector_map::NONTRIMMED);
+	im->hash_invalid = true;	// the image is no longer written in order
+	pos += n;
+	if(skipping){
+	    pos += skip;		// left for pass 2
+	    skip *= 2;
+	    if(skip>max_skip) skip = max_skip;
+	}
+    }
+}
+
+void recovery::trim_pass()
+{
+    sector_map *map = im->smap;
+    uint64_t pos = 0;
+    uint64_t len = 0;
+    while(!out_of_time() && map->find(sector_map::NONTRIMMED,pos,&pos,&len)){
+	uint64_t start = pos;
+	uint64_t end   = pos+len;
+	bool head_done = false;
+	bool tail_done = false;
+	while(start<end && !head_done && !out_of_time()){
+	    head_done = !read_sector(start);
+	    start += sector_size;
+	}
+	while(end>start && !tail_done && !out_of_time()){
+	    tail_done = !read_sector(end-sector_size);
+	    end -= sector_size;
+	}
+	if(end>start && head_done && tail_done){
+	    map->mark(start,end-start,sector_map::NONSCRAPED);
+	}
+	pos += len;
+    }
+}
+
+void recovery::scrape_pass()
+{
+    sector_map *map = im->smap;
+    uint64_t pos = 0;
+    uint64_t len = 0;
+    while(!out_of_time() && map->find(sector_map::NONSCRAPED,pos,&pos,&len)){
+	uint64_t end = pos+len;
+	for(;pos<end && !out_of_time();pos+=sector_size){
+	    read_sector(pos);
+	}
+    }
+}
+
+/* A pass that ran out of time leaves parts of the map unread. Write
+ * the bad flag there too, so that they don't read back as zeros.
+ */
+void recovery::give_up()
+{
+    static const sector_map::status left[] = {
+	sector_map::UNREAD, sector_map::NONTRIMMED, sector_map::NONSCRAPED
+    };
+    sector_map *map = im->smap;
+    uint64_t given_up = 0;
+    for(size_t i=0;i<sizeof(left)/sizeof(left[0]);i++){
+	uint64_t pos = 0;
+	uint64_t len = 0;
+	while(map->find(left[i],pos,&pos,&len)){
+	    int n = len < (uint64_t)chunk ? (int)len : chunk;
+	    write_bad(pos,n);
+	    given_up += n / sector_size;
+	    pos += n;
+	}
+    }
+    if(given_up){
+	im->hash_invalid = true;
+	fprintf(stderr,"%" PRIu64 " sectors were not read before time ran out; "
+		"they are flagged as bad\n",given_up);
+    }
+}
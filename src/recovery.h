@@ -0,0 +1,70 @@
+/*
+ * recovery.h:
+ * Multi-pass recovery of a failing drive (-e2), after ddrescue.
+ *
+ * The aim is to get as much of the drive as possible before it gets
+ * worse, so the healthy parts are read first and the bad areas are
+ * left for last:
+ *
+ *  1. copy: read forward, readsectors at a time, over everything not
+ *     yet read. A failed read marks its chunk NONTRIMMED and skips
+ *     ahead; the skip starts at MIN_SKIP and doubles with every
+ *     failure in a row, up to 1% of the drive. With --slow_read, a
+ *     read that takes too long skips ahead the same way.
+ *  2. copy again, without skipping, over what pass 1 skipped.
+ *  3. trim: read each NONTRIMMED chunk a sector at a time, forward
+ *     from its start and backward from its end, until a read fails.
+ *     The failed sectors are BAD; what lies between is NONSCRAPED.
+ *  4. scrape: read every NONSCRAPED sector on its own.
+ *
+ * All of the bookkeeping is in the imager's sector_map, so a pass
+ * only has to look for the extents it works on. Each pass may be
+ * given a time budget; when it runs out, the pass stops where it is
+ * and the next one starts. Sectors that are given up on are written
+ * with the bad flag and counted as bad, and so is whatever the passes
+ * did not get to, so the image never reads as zeros where nothing was
+ * read.
+ */
+
+#ifndef RECOVERY_H
+#define RECOVERY_H
+
+#include <stdint.h>
+#include <chrono>
+
+class imager;
+
+class recovery {
+public:
+    static const uint64_t MIN_SKIP = 64*1024;
+
+    recovery(imager *im,int readsectors,int pass_seconds);
+    ~recovery();
+    void run();
+
+private:
+    recovery(const recovery &);			// not implemented
+    recovery &operator=(const recovery &);	// not implemented
+
+    void copy_pass(bool skipping);
+    void trim_pass();
+    void scrape_pass();
+    void give_up();			// on what the passes didn't get to
+    void start_pass(int pass);
+    bool out_of_time();
+
+    int  read(uint64_t pos,int len);	// into buf; returns bytes read, or -1
+    bool read_sector(uint64_t pos);	// read, write and mark one sector
+    void write(uint64_t pos,int len);	// buf to the output
+    void write_bad(uint64_t pos,int len); // the bad flag, for whole sectors
+
+    imager   *im;
+    unsigned char *buf;
+    int      chunk;			// bytes per copy read
+    int      sector_size;
+    int      pass_seconds;		// 0 for no limit
+    std::chrono::steady_clock::time_point pass_start;
+    double   read_seconds;		// how long the last read took
+};
+
+#endif
@@ -0,0 +1,162 @@
+/*
+ * sector_map.cpp:
+ * The extent map of what has been read, and its two file formats.
+ */
+
+#include "config.h"
+#include "sector_map.h"
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <time.h>
+
+sector_map::sector_map(uint64_t size_):map(),map_size(size_)
+{
+    if(map_size>0){
+	extent e = {map_size,UNREAD};
+	map[0] = e;
+    }
+}
+
+void sector_map::split(uint64_t pos)
+{
+    extent_map::iterator it = map.upper_bound(pos);
+    if(it==map.begin()) return;
+    --it;
+    if(it->first<pos && pos<it->second.end){
+	map[pos] = it->second;
+	it->second.end = pos;
+    }
+}
+
+void sector_map::merge(extent_map::iterator it)
+{
+    if(it!=map.begin()){
+	extent_map::iterator prev = it;
+	--prev;
+	if(prev->second.end==it->first && prev->second.s==it->second.s){
+	    prev->second.end = it->second.end;
+	    map.erase(it);
+	    it = prev;
+	}
+    }
+    extent_map::iterator next = it;
+    ++next;
+    if(next!=map.end() && it->second.end==next->first && it->second.s==next->second.s){
+	it->second.end = next->second.end;
+	map.erase(next);
+    }
+}
+
+void sector_map::mark(uint64_t pos,uint64_t len,status s)
+{
+    if(len==0) return;
+    uint64_t end = pos+len;
+    if(end>map_size){			// input larger than we knew
+	extent e = {end,UNREAD};
+	map[map_size] = e;
+	merge(map.find(map_size));
+	map_size = end;
+    }
+    split(pos);
+    split(end);
+    map.erase(map.lower_bound(pos),map.lower_bound(end));
+    extent e = {end,s};
+    merge(map.insert(extent_map::value_type(pos,e)).first);
+}
+
+uint64_t sector_map::bytes(status s) const
+{
+    uint64_t total = 0;
+    for(extent_map::const_iterator it=map.begin();it!=map.end();++it){
+	if(it->second.s==s) total += it->second.end - it->first;
+    }
+    return total;
+}
+
+std::string sector_map::encode() const
+{
+    std::string buf;
+    for(extent_map::const_iterator it=map.begin();it!=map.end();++it){
+	uint64_t len = it->second.end - it->first;
+	buf += (char)it->second.s;
+	for(int shift=56;shift>=0;shift-=8){
+	    buf += (char)((len >> shift) & 0xff);
+	}
+    }
+    return buf;
+}
+
+bool sector_map::decode(const unsigned char *buf,size_t len)
+{
+    if(len % 9 != 0) return false;
+    extent_map m;
+    uint64_t start = 0;
+    for(size_t i=0;i<len;i+=9){
+	status s = (status)buf[i];
+	switch(s){
+	case UNREAD: case NONTRIMMED: case NONSCRAPED: case GOOD: case BLANK: case BAD:
+	    break;
+	default:
+	    return false;
+	}
+	uint64_t elen = 0;
+	for(int j=1;j<=8;j++){
+	    elen = (elen << 8) | buf[i+j];
+	}
+	if(elen==0) continue;
+	extent e = {start+elen,s};
+	m[start] = e;
+	start += elen;
+    }
+    map.swap(m);
+    map_size = start;
+    return true;
+}
+
+/* Find the first part of the map at or after from with status s */
+bool sector_map::find(status s,uint64_t from,uint64_t *pos,uint64_t *len) const
+{
+    extent_map::const_iterator it = map.upper_bound(from);
+    if(it!=map.begin()) --it;
+    for(;it!=map.end();++it){
+	if(it->second.s!=s || it->second.end<=from) continue;
+	*pos = it->first > from ? it->first : from;
+	*len = it->second.end - *pos;
+	return true;
+    }
+    return false;
+}
+
+int sector_map::write_mapfile(const char *fname,uint64_t current_pos,
+			      char current_status,int current_pass) const
+{
+    FILE *f = fopen(fname,"w");
+    if(!f) return -1;
+
+    time_t now = time(0);
+    char when[64];
+    strftime(when,sizeof(when),"%Y-%m-%d %H:%M:%S",localtime(&now));
+
+    fprintf(f,"# Mapfile. Created by aimage %s\n",PACKAGE_VERSION);
+    fprintf(f,"# Current time: %s\n",when);
+    fprintf(f,"# current_pos  current_status  current_pass\n");
+    fprintf(f,"0x%08" PRIX64 "     %c               %d\n",
+	    current_pos,current_status,current_pass);
+    fprintf(f,"#      pos        size  status\n");
+    extent_map::const_iterator it = map.begin();
+    while(it!=map.end()){
+	/* BLANK and GOOD look the same to ddrescue; write runs of both as one */
+	char c = it->second.s==BLANK ? (char)GOOD : (char)it->second.s;
+	uint64_t start = it->first;
+	uint64_t end   = it->second.end;
+	for(++it;it!=map.end();++it){
+	    char c2 = it->second.s==BLANK ? (char)GOOD : (char)it->second.s;
+	    if(c2!=c) break;
+	    end = it->second.end;
+	}
+	fprintf(f,"0x%08" PRIX64 "  0x%08" PRIX64 "  %c\n",start,end-start,c);
+    }
+    if(fclose(f)) return -1;
+    return 0;
+}
@@ -0,0 +1,69 @@
+/*
+ * sector_map.h:
+ * Where on the input the good, blank, bad and unread regions are.
+ *
+ * The map is a list of extents, in bytes, each with one status;
+ * neighbouring extents with the same status are merged, so a drive
+ * that reads cleanly is a handful of extents however large it is.
+ * If the size of the input is known, the map starts out as one
+ * UNREAD extent covering all of it; otherwise it grows as data is
+ * marked.
+ *
+ * The map is saved in two forms:
+ *  - encode() gives the contents of the AIMAGE_SECTOR_MAP segment:
+ *    for each extent in order, its status character followed by its
+ *    length as an 8-byte big-endian number. decode() reads it back,
+ *    for --append.
+ *  - write_mapfile() writes a GNU ddrescue mapfile, so that ddrescue
+ *    (or ddrescuelog) can be pointed at the holes. ddrescue has no
+ *    status for blank data, so BLANK is written there as finished.
+ *    current_status is ddrescue's: '?' copying, '*' trimming,
+ *    '/' scraping, '+' finished.
+ */
+
+#ifndef SECTOR_MAP_H
+#define SECTOR_MAP_H
+
+#include <stdint.h>
+#include <map>
+#include <string>
+
+class sector_map {
+public:
+    enum status {			// the characters are ddrescue's where it has one
+	UNREAD     = '?',
+	NONTRIMMED = '*',		// a read failed somewhere in here (-e2)
+	NONSCRAPED = '/',		// edges trimmed, the rest not yet tried (-e2)
+	GOOD       = '+',
+	BLANK      = 'z',
+	BAD        = '-'
+    };
+
+    sector_map(uint64_t size);		// 0 if the size is not known
+
+    void     mark(uint64_t pos,uint64_t len,status s);
+    uint64_t bytes(status s) const;	// total size of the extents with status s
+    size_t   extents() const { return map.size(); }
+    uint64_t size() const { return map_size; }
+    bool     find(status s,uint64_t from,uint64_t *pos,uint64_t *len) const; // next part with s
+
+    std::string encode() const;
+    bool decode(const unsigned char *buf,size_t len); // from encode(); false if malformed
+    int write_mapfile(const char *fname,uint64_t current_pos,
+		      char current_status='+',int current_pass=1) const;
+
+private:
+    struct extent {
+	uint64_t end;
+	status   s;
+    };
+    typedef std::map<uint64_t,extent> extent_map; // keyed by start
+
+    void split(uint64_t pos);		// make an extent start at pos
+    void merge(extent_map::iterator it); // with its neighbours, if they match
+
+    extent_map map;
+    uint64_t map_size;
+};
+
+#endif
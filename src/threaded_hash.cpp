@@ -0,0 +1,123 @@
+/*
+ * threaded_hash.cpp:
+ * The hashing threads used by aimage -2.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <string.h>
+#include "threaded_hash.h"
+
+threaded_hash::hash_worker::hash_worker(update_fn fn_):
+    fn(fn_),M(),work_ready(),pending(),finished(false),thread()
+{
+    thread = std::thread(&threaded_hash::hash_worker::run,this);
+}
+
+void threaded_hash::hash_worker::push(const hash_buffer &b)
+{
+    std::lock_guard<std::mutex> lock(M);
+    pending.push_back(b);
+    work_ready.notify_one();
+}
+
+void threaded_hash::hash_worker::run()
+{
+    while(true){
+	hash_buffer b;
+	{
+	    std::unique_lock<std::mutex> lock(M);
+	    work_ready.wait(lock,[this]{ return pending.size()>0 || finished; });
+	    if(pending.empty()) return;	// finished and drained
+	    b = pending.front();
+	    pending.pop_front();
+	}
+	if(b->size()) fn(b->data(),b->size());
+	/* Our reference to b is dropped here; the last worker recycles it */
+    }
+}
+
+void threaded_hash::hash_worker::join()
+{
+    {
+	std::lock_guard<std::mutex> lock(M);
+	finished = true;
+	work_ready.notify_one();
+    }
+    if(thread.joinable()) thread.join();
+}
+
+
+threaded_hash::threaded_hash(md5_generator *md5,sha1_generator *sha1,
+			     sha256_generator *sha256,size_t max_pending_):
+    workers(),max_pending(max_pending_ ? max_pending_ : 1),
+    M(),space_ready(),freelist(),in_flight(0)
+{
+    add_worker(md5);
+    add_worker(sha1);
+    add_worker(sha256);
+}
+
+threaded_hash::~threaded_hash()
+{
+    join();
+    for(size_t i=0;i<workers.size();i++){
+	delete workers[i];
+    }
+    for(size_t i=0;i<freelist.size();i++){
+	delete freelist[i];
+    }
+}
+
+void threaded_hash::recycle(std::vector<uint8_t> *b)
+{
+    std::lock_guard<std::mutex> lock(M);
+    freelist.push_back(b);
+    in_flight--;
+    space_ready.notify_all();		// update() and drain() both wait for this
+}
+
+/* Copy the buffer once and hand it to every hashing thread.
+ * Blocks if max_pending buffers are already in flight.
+ */
+void threaded_hash::update(const uint8_t *buf,size_t bufsize)
+{
+    std::vector<uint8_t> *copy = 0;
+    {
+	std::unique_lock<std::mutex> lock(M);
+	space_ready.wait(lock,[this]{ return in_flight < max_pending; });
+	in_flight++;
+	if(freelist.size()){
+	    copy = freelist.back();
+	    freelist.pop_back();
+	}
+    }
+    if(!copy) copy = new std::vector<uint8_t>();
+    copy->assign(buf,buf+bufsize);	// done without the lock held
+
+    hash_buffer b(copy,[this](const std::vector<uint8_t> *v){
+	    recycle(const_cast<std::vector<uint8_t> *>(v));
+	});
+    for(size_t i=0;i<workers.size();i++){
+	workers[i]->push(b);
+    }
+}
+
+/* Wait for every buffer handed out so far to be hashed by every thread.
+ * A buffer is recycled only after the last thread is done with it.
+ */
+void threaded_hash::drain()
+{
+    std::unique_lock<std::mutex> lock(M);
+    space_ready.wait(lock,[this]{ return in_flight==0; });
+}
+
+/* Wait for all of the buffers to be hashed and stop the threads.
+ * Safe to call more than once.
+ */
+void threaded_hash::join()
+{
+    for(size_t i=0;i<workers.size();i++){
+	workers[i]->join();
+    }
+}
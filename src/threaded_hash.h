@@ -0,0 +1,87 @@
+/*
+ * threaded_hash.h:
+ * Compute the MD5, SHA1 and SHA256 of the image in background threads,
+ * so that hashing does not hold up reading from the drive.
+ *
+ * Each algorithm runs in its own thread. update() makes one copy of the
+ * buffer and hands a reference-counted pointer to it to every thread;
+ * the copy is recycled when the last thread is done with it. Hashing
+ * therefore takes as long as the slowest algorithm, not the sum of all
+ * three.
+ *
+ * At most max_pending buffers are in flight. If the slowest thread
+ * falls behind, update() blocks until a buffer is recycled.
+ * join() waits until every buffer has been hashed by every thread.
+ * It must be called before final() is called on any of the generators.
+ * drain() waits the same way but leaves the threads running, so that
+ * the generators can be peek()ed at in the middle of the image.
+ */
+
+#ifndef THREADED_HASH_H
+#define THREADED_HASH_H
+
+#include "hash_t.h"
+
+#include <deque>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+class threaded_hash {
+public:
+    static const size_t DEFAULT_MAX_PENDING = 4;
+
+    typedef std::shared_ptr<const std::vector<uint8_t> > hash_buffer;
+
+    threaded_hash(md5_generator *md5,sha1_generator *sha1,sha256_generator *sha256,
+		  size_t max_pending=DEFAULT_MAX_PENDING);
+    ~threaded_hash();
+
+    void update(const uint8_t *buf,size_t bufsize);
+    void drain();			// wait until everything given so far is hashed
+    void join();			// wait for all threads to drain and stop them
+
+private:
+    threaded_hash(const threaded_hash &);		// not implemented
+    threaded_hash &operator=(const threaded_hash &);	// not implemented
+
+    /* One thread per hash algorithm */
+    class hash_worker {
+    public:
+	typedef std::function<void(const uint8_t *,size_t)> update_fn;
+	hash_worker(update_fn fn);
+	void push(const hash_buffer &b);
+	void join();
+    private:
+	hash_worker(const hash_worker &);		// not implemented
+	hash_worker &operator=(const hash_worker &);	// not implemented
+	void run();
+	update_fn fn;
+	std::mutex M;
+	std::condition_variable work_ready;
+	std::deque<hash_buffer> pending;
+	bool finished;
+	std::thread thread;
+    };
+
+    template<typename T> void add_worker(hash_generator__<T> *gen){
+	workers.push_back(new hash_worker([gen](const uint8_t *buf,size_t bufsize){
+		    gen->update(buf,bufsize);
+		}));
+    }
+
+    void recycle(std::vector<uint8_t> *b);	// called when the last reference is dropped
+
+    std::vector<hash_worker *> workers;
+    size_t max_pending;
+
+    std::mutex M;			// protects the buffer pool
+    std::condition_variable space_ready;	// broadcast when a buffer is recycled
+    std::vector<std::vector<uint8_t> *> freelist;	// buffers we can reuse
+    size_t in_flight;			// buffers handed out and not yet recycled
+};
+
+#endif
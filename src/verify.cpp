@@ -0,0 +1,440 @@
+/*
+ * verify.cpp:
+ * Multithreaded --verify.
+ */
+
+#include "config.h"
+#include "aimage.h"
+#include "verify.h"
+#include "input_source.h"
+#include "window_hash.h"
+#include "threaded_hash.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <chrono>
+
+verifier::verifier(const char *source_,const char *image_,int nthreads_):
+    source(source_),image(image_),nthreads(nthreads_),image_size(0),unit_size(0),units(0),
+    digests(),have_digest(),next_unit(0),M(),bad(),failed(false)
+{
+    if(nthreads<1) nthreads = 1;
+}
+
+/* As imager::open_input(), a buffered descriptor is kept for the
+ * reads that O_DIRECT can't do.
+ */
+input_source *verifier::open_source(const char *name,bool direct,int fds[2])
+{
+    fds[0] = fds[1] = -1;
+    if(strncmp(name,"sim:",4)==0){
+	return sim_source::open(name+4);
+    }
+    fds[0] = open(name,O_RDONLY);
+    if(fds[0]<0) return 0;
+#ifdef O_DIRECT
+    if(direct){
+	fds[1] = open(name,O_RDONLY|O_DIRECT);
+	struct stat st;
+	if(fds[1]>=0 && fstat(fds[1],&st)==0){
+	    int io_align = st.st_blksize > 512 ? st.st_blksize : 512;
+	    return new fd_source(fds[1],fds[0],io_align);
+	}
+    }
+#endif
+    return new fd_source(fds[0]);
+}
+
+void verifier::close_source(input_source *src,int fds[2])
+{
+    delete src;
+    for(int i=0;i<2;i++){
+	if(fds[i]>=0) close(fds[i]);
+	fds[i] = -1;
+    }
+}
+
+/* pread() until len bytes are read; a short count only at the end */
+int verifier::read_source(input_source *src,unsigned char *buf,uint64_t offset,int len)
+{
+    int total = 0;
+    while(total<len){
+	int got = src->pread(buf+total,len-total,offset+total);
+	if(got<0) return -1;
+	if(got==0) break;
+	total += got;
+    }
+    return total;
+}
+
+/* Print the units that did not verify, with neighbouring ones together */
+static void report(std::vector<uint64_t> &bad,uint64_t unit_size,uint64_t image_size,
+		   const char *units)
+{
+    std::sort(bad.begin(),bad.end());
+    for(size_t i=0;i<bad.size();){
+	size_t j = i+1;
+	while(j<bad.size() && bad[j]==bad[j-1]+1) j++;
+	uint64_t start = bad[i] * unit_size;
+	uint64_t end   = (bad[j-1]+1) * unit_size;
+	if(end>image_size) end = image_size;
+	fprintf(stderr,"Does not verify: bytes %" PRIu64 "-%" PRIu64 " (%s %" PRIu64 "-%" PRIu64 ")\r\n",
+		start,end-1,units,bad[i],bad[j-1]);
+	i = j;
+    }
+}
+
+bool verifier::check(uint64_t unit,input_source *src,AFFILE *af,
+		     unsigned char *buf1,unsigned char *buf2)
+{
+    uint64_t offset = unit * unit_size;
+    uint64_t len = image_size-offset < unit_size ? image_size-offset : unit_size;
+
+    for(uint64_t done=0;done<len;){
+	int n = len-done < AFF_DEFAULT_PAGESIZE ? (int)(len-done) : AFF_DEFAULT_PAGESIZE;
+	if(read_source(src,buf1,offset+done,n)!=n) return false;
+	if(af_seek(af,offset+done,SEEK_SET)<0) return false;
+	if(af_read(af,buf2,n)!=n) return false;
+	if(memcmp(buf1,buf2,n)!=0) return false;
+	done += n;
+    }
+    return true;
+}
+
+void verifier::worker()
+{
+    int fds[2];
+    input_source *src = open_source(source,false,fds);
+    AFFILE *af = af_open(image,O_RDONLY,0777);
+    unsigned char *buf1 = (unsigned char *)malloc(AFF_DEFAULT_PAGESIZE);
+    unsigned char *buf2 = (unsigned char *)malloc(AFF_DEFAULT_PAGESIZE);
+    if(!src || !af || !buf1 || !buf2){
+	std::lock_guard<std::mutex> lock(M);
+	if(!failed) warn("verify: cannot open %s",!src ? source : image);
+	failed = true;
+    }
+    else {
+	for(uint64_t unit=next_unit++;unit<units;unit=next_unit++){
+	    if(!check(unit,src,af,buf1,buf2)){
+		std::lock_guard<std::mutex> lock(M);
+		bad.push_back(unit);
+	    }
+	}
+    }
+    free(buf1);
+    free(buf2);
+    if(af) af_close(af);
+    close_source(src,fds);
+}
+
+bool verifier::source_longer()
+{
+    int fds[2];
+    input_source *src = open_source(source,false,fds);
+    unsigned char extra;
+    bool longer = src && src->pread(&extra,1,image_size)>0;
+    close_source(src,fds);
+    if(longer){
+	fprintf(stderr,"%s is longer than the %" PRIu64 " bytes in %s\r\n",source,image_size,image);
+    }
+    return longer;
+}
+
+int verifier::run()
+{
+    AFFILE *af = af_open(image,O_RDONLY,0777);
+    if(!af){
+	warn("%s",image);
+	return -1;
+    }
+    image_size = af_get_imagesize(af);
+    unit_size  = window_hash::stored_window(af);
+    const char *unit_name = unit_size>0 ? "windows" : "pages";
+    if(unit_size==0) unit_size = af_get_pagesize(af);
+    if(unit_size==0) unit_size = AFF_DEFAULT_PAGESIZE;
+    units = (image_size + unit_size - 1) / unit_size;
+    af_close(af);
+
+    printf("Validating %s with %s: %" PRIu64 " %s of %" PRIu64 " bytes on %d thread%s\r\n",
+	   source,image,units,unit_name,unit_size,
+	   nthreads,nthreads==1 ? "" : "s");
+
+    std::vector<std::thread> threads;
+    for(int i=0;i<nthreads;i++){
+	threads.push_back(std::thread(&verifier::worker,this));
+    }
+    for(size_t i=0;i<threads.size();i++){
+	threads[i].join();
+    }
+    if(failed) return -1;
+
+    bool longer = source_longer();
+    report(bad,unit_size,image_size,unit_name);
+    if(bad.size() || longer) return -2;
+    printf("%s verifys\r\n",image);
+    return 0;
+}
+
+/* Fetch a stored hash; false if the image doesn't have it */
+template<typename T> static bool get_hash(AFFILE *af,const char *name,T *digest)
+{
+    size_t len = digest->SIZE;
+    return af_get_seg(af,name,0,digest->digest,&len)==0 && len==digest->SIZE;
+}
+
+template<typename T> static bool same_hash(const char *name,const T &stored,const T &computed)
+{
+    char buf1[T::SIZE*2+1];
+    char buf2[T::SIZE*2+1];
+    if(stored==computed){
+	printf("%s matches: %s\r\n",name,computed.hexdigest(buf1,sizeof(buf1)));
+	return true;
+    }
+    fprintf(stderr,"%s does not match: stored %s, drive %s\r\n",name,
+	    stored.hexdigest(buf1,sizeof(buf1)),computed.hexdigest(buf2,sizeof(buf2)));
+    return false;
+}
+
+int verifier::run_hashes()
+{
+    AFFILE *af = af_open(image,O_RDONLY,0777);
+    if(!af){
+	warn("%s",image);
+	return -1;
+    }
+    image_size = af_get_imagesize(af);
+    md5_t md5;
+    sha1_t sha1;
+    sha256_t sha256;
+    sha256_t root;
+    bool have_md5    = get_hash(af,AF_MD5,&md5);
+    bool have_sha1   = get_hash(af,AF_SHA1,&sha1);
+    bool have_sha256 = get_hash(af,AF_SHA256,&sha256);
+    bool linear      = have_md5 || have_sha1 || have_sha256;
+    bool tree        = !linear && window_hash::get_root(af,&root);
+    if(tree){
+	unit_size = window_hash::stored_window(af);
+	units = unit_size ? (image_size + unit_size - 1) / unit_size : 0;
+	digests.resize(units);
+	have_digest.resize(units);
+	for(uint64_t n=0;n<units;n++){
+	    have_digest[n] = window_hash::get(af,n,&digests[n]);
+	}
+	if(unit_size==0) tree = false;
+    }
+    af_close(af);
+    if(!linear && !tree){
+	warnx("%s has no hashes to verify against; comparing it with %s instead",image,source);
+	return run();
+    }
+
+    int fds[2];
+    input_source *src = open_source(source,opt_direct,fds);
+    unsigned char *buf = 0;
+    void *p = 0;
+    if(posix_memalign(&p,4096,AFF_DEFAULT_PAGESIZE)==0) buf = (unsigned char *)p;
+    if(!src || !buf){
+	warn("verify: cannot read %s",source);
+	close_source(src,fds);
+	free(buf);
+	return -1;
+    }
+    printf("Hashing %" PRIu64 " bytes of %s to check against the %s in %s\r\n",
+	   image_size,source,linear ? "hashes" : "tree hash",image);
+
+    md5_generator    g_md5;
+    sha1_generator   g_sha1;
+    sha256_generator g_sha256;
+    threaded_hash   *th = linear ? new threaded_hash(&g_md5,&g_sha1,&g_sha256) : 0;
+    sha256_generator g_window;
+    std::vector<sha256_t> windows;
+    bool read_failed = false;
+    for(uint64_t offset=0;offset<image_size;){
+	int n = image_size-offset < AFF_DEFAULT_PAGESIZE ? (int)(image_size-offset) : AFF_DEFAULT_PAGESIZE;
+	int got = read_source(src,buf,offset,n);
+	if(got!=n){
+	    fprintf(stderr,"Cannot read %s at %" PRIu64 "\r\n",source,offset+(got>0 ? got : 0));
+	    read_failed = true;
+	    break;
+	}
+	if(th) th->update(buf,n);	// hashed while we read the next block
+	for(int pos=0;tree && pos<n;){
+	    uint64_t at = offset+pos;
+	    uint64_t window_left = unit_size - at % unit_size;
+	    int count = window_left < (uint64_t)(n-pos) ? (int)window_left : n-pos;
+	    g_window.update(buf+pos,count);
+	    pos += count;
+	    if((at+count) % unit_size==0 || at+count==image_size){
+		windows.push_back(g_window.final());
+		g_window.init();
+	    }
+	}
+	offset += n;
+    }
+    if(th){
+	th->join();
+	delete th;
+    }
+    close_source(src,fds);
+    free(buf);
+    if(read_failed) return -2;
+
+    bool ok = true;
+    if(have_md5)    ok = same_hash("MD5",md5,g_md5.final()) && ok;
+    if(have_sha1)   ok = same_hash("SHA1",sha1,g_sha1.final()) && ok;
+    if(have_sha256) ok = same_hash("SHA256",sha256,g_sha256.final()) && ok;
+    if(tree){
+	ok = same_hash("Tree SHA256",root,window_hash::root_of(windows)) && ok;
+	for(uint64_t n=0;n<windows.size();n++){
+	    if(have_digest[n] && !(windows[n]==digests[n])){
+		fprintf(stderr,"Does not verify: bytes %" PRIu64 "-%" PRIu64 " (window %" PRIu64 ")\r\n",
+			n*unit_size,n*unit_size+unit_size-1,n);
+	    }
+	}
+    }
+    if(source_longer()) ok = false;
+    if(!ok) return -2;
+    printf("%s verifys\r\n",image);
+    return 0;
+}
+
+
+/****************************************************************
+ *** readback_verifier
+ ****************************************************************/
+
+readback_verifier::readback_verifier(const char *image_,uint64_t window):
+    image(image_),window_size(window),buf(window),M(),work_ready(),todo(),suspect(),bad(),
+    closed(false),checked_total(0),checked_early(0),thread()
+{
+    thread = std::thread(&readback_verifier::run,this);
+}
+
+readback_verifier::~readback_verifier()
+{
+    if(thread.joinable()) finish();
+}
+
+void readback_verifier::add(uint64_t n,const sha256_t &digest)
+{
+    std::lock_guard<std::mutex> lock(M);
+    todo[n] = digest;			// a later digest replaces an earlier one
+    suspect.erase(n);
+    work_ready.notify_one();
+}
+
+readback_verifier::result readback_verifier::check(AFFILE *af,uint64_t n,
+						   const sha256_t &digest,bool closed_)
+{
+    uint64_t start = n * window_size;
+    uint64_t pagesize = af_get_pagesize(af);
+    if(!closed_ && pagesize>0){
+	/* Are all of the pages there yet? */
+	for(uint64_t page=start/pagesize;page<=(start+window_size-1)/pagesize;page++){
+	    char name[AF_MAX_NAME_LEN];
+	    snprintf(name,sizeof(name),AF_PAGE,(int64)page);
+	    size_t len = 0;
+	    if(af_get_seg(af,name,0,0,&len)) return NOT_YET;
+	}
+    }
+    if(af_seek(af,start,SEEK_SET)<0) return closed_ ? DIFFERS : NOT_YET;
+    int got = af_read(af,buf.data(),window_size);
+    if(got<=0) return closed_ ? DIFFERS : NOT_YET;
+    if((uint64_t)got<window_size && !closed_) return NOT_YET; // the last one, or not all there
+    return sha256_generator::hash_buf(buf.data(),got)==digest ? MATCHES : DIFFERS;
+}
+
+void readback_verifier::run()
+{
+    AFFILE *af = 0;
+    bool af_closed = false;		// af was opened after af_close()
+    std::chrono::steady_clock::time_point last_open;
+    std::chrono::duration<double> interval(0);
+    std::unique_lock<std::mutex> lock(M);
+    while(true){
+	while(todo.empty() && !closed) work_ready.wait(lock);
+	if(todo.empty()) break;		// closed, and nothing is left
+
+	/* Open the image again if it has more on disk than af can see */
+	if(!af || (closed && !af_closed)){
+	    if(af){
+		af_close(af);
+		af = 0;
+	    }
+	    if(!closed){
+		std::chrono::steady_clock::time_point when = last_open +
+		    std::chrono::duration_cast<std::chrono::steady_clock::duration>(interval);
+		if(work_ready.wait_until(lock,when)!=std::cv_status::timeout && !closed) continue;
+	    }
+	    bool closed_now = closed;
+	    lock.unlock();
+	    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+	    af = af_open(image,O_RDONLY,0777);
+	    last_open = std::chrono::steady_clock::now();
+	    interval = (last_open - t0) * 10;
+	    if(interval < std::chrono::seconds(1)) interval = std::chrono::seconds(1);
+	    lock.lock();
+	    af_closed = closed_now;
+	    if(!af){
+		if(!af_closed) continue;	// try again later
+		warn("%s",image);
+		for(std::map<uint64_t,sha256_t>::const_iterator it=todo.begin();it!=todo.end();++it){
+		    bad.push_back(it->first);
+		}
+		todo.clear();
+		break;
+	    }
+	}
+
+	uint64_t n = todo.begin()->first;
+	sha256_t digest = todo.begin()->second;
+	bool closed_now = af_closed;
+	lock.unlock();
+	result r = check(af,n,digest,closed_now);
+	lock.lock();
+
+	if(r==NOT_YET){
+	    af_close(af);		// wait, then look again
+	    af = 0;
+	    continue;
+	}
+	std::map<uint64_t,sha256_t>::iterator it = todo.find(n);
+	if(it==todo.end() || !(it->second==digest)) continue; // added again meanwhile
+	todo.erase(it);
+	if(r==MATCHES){
+	    checked_total++;
+	    if(!closed_now) checked_early++;
+	}
+	else if(closed_now){
+	    bad.push_back(n);
+	}
+	else {
+	    suspect[n] = digest;	// maybe rewritten since; try again at the end
+	}
+    }
+    lock.unlock();
+    if(af) af_close(af);
+}
+
+int readback_verifier::finish()
+{
+    {
+	std::lock_guard<std::mutex> lock(M);
+	closed = true;
+	todo.insert(suspect.begin(),suspect.end());
+	suspect.clear();
+	work_ready.notify_one();
+    }
+    thread.join();
+
+    if(bad.empty()) return 0;
+    AFFILE *af = af_open(image,O_RDONLY,0777);
+    uint64_t image_size = af ? af_get_imagesize(af) : 0;
+    if(af) af_close(af);
+    report(bad,window_size,image_size,"windows");
+    return -2;
+}
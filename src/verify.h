@@ -0,0 +1,131 @@
+/*
+ * verify.h:
+ * Checking a finished image against the drive it was made from
+ * (--verify).
+ *
+ * The image is split into units, which threads take in turn, so
+ * several parts of the drive and the image are read at once. Each
+ * thread has its own descriptor on the drive and its own AFFILE for
+ * the image, as afflib is not thread-safe.
+ *
+ * The drive and the image are read and compared. If the image has
+ * --hash_window digests, a unit is a window; otherwise it is an AFF
+ * page. The digests themselves are only checked by --verify_hash:
+ * once the bytes match, hashing them too would add nothing.
+ *
+ * A unit that differs, or that can't be read, doesn't stop the rest.
+ * run() reports the byte ranges of the units that did not verify,
+ * with neighbouring ones put together, and returns 0 only if there
+ * were none.
+ *
+ * run_hashes() (--verify_hash) only shows that the drive still hashes
+ * to what was stored when it was imaged, which is often all that is
+ * needed. It reads the drive once, front to back, in large aligned
+ * reads (with O_DIRECT, given --direct) and hashes it on the threads
+ * that -2 uses, while the next read is under way. The image is
+ * never read, so this is half the I/O of run() and no decompression.
+ * The MD5, SHA1 and SHA256 are checked if the image has them. An
+ * image that wasn't read in order has none; then the --tree_hash
+ * root is checked, if it has one, and the windows that differ are
+ * reported. With neither, it falls back to run().
+ *
+ * readback_verifier (--verify_readback) checks the image while it is
+ * being made, instead of after. Each time window_hash stores the
+ * digest of a window, the window is queued for a background thread,
+ * which reads it back from the image through its own AFFILE and
+ * compares its SHA256. That AFFILE only sees what was on disk when it
+ * was opened, so when the window it wants isn't there yet the thread
+ * waits and opens the image again. It waits at least a second, and at
+ * least ten times as long as the last open took, so that reopening a
+ * large image is never much of the work. A window that doesn't match
+ * before the image is closed may just have been rewritten since, so
+ * it is checked again afterwards. finish() is called once af_close()
+ * has written everything out: it checks whatever is left and reports
+ * the windows that did not read back.
+ */
+
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include "hash_t.h"
+
+#include <stdint.h>
+#include <vector>
+#include <map>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <afflib/afflib.h>
+
+class input_source;
+
+class verifier {
+public:
+    verifier(const char *source,const char *image,int nthreads);
+    int run();				// 0 if it verifies, -1 if it could not start, -2 if not
+    int run_hashes();			// the same, against the stored hashes
+
+    /* To read name again; fds are closed by close_source(). 0 on error */
+    static input_source *open_source(const char *name,bool direct,int fds[2]);
+    static void close_source(input_source *src,int fds[2]);
+
+private:
+    verifier(const verifier &);			// not implemented
+    verifier &operator=(const verifier &);	// not implemented
+
+    void worker();
+    bool check(uint64_t unit,input_source *src,AFFILE *af,
+	       unsigned char *buf1,unsigned char *buf2);
+    int  read_source(input_source *src,unsigned char *buf,uint64_t offset,int len);
+    bool source_longer();		// is there more on the drive than in the image?
+
+    const char *source;
+    const char *image;
+    int      nthreads;
+    uint64_t image_size;
+    uint64_t unit_size;			// the window or the page
+    uint64_t units;
+    std::vector<sha256_t> digests;	// for each window, with --verify_hash
+    std::vector<bool> have_digest;
+
+    std::atomic<uint64_t> next_unit;	// the next one for a thread to take
+    std::mutex M;			// protects bad and failed
+    std::vector<uint64_t> bad;		// units that did not verify
+    bool     failed;			// a thread could not open its files
+};
+
+class readback_verifier {
+public:
+    readback_verifier(const char *image,uint64_t window);
+    ~readback_verifier();
+
+    void add(uint64_t n,const sha256_t &digest); // window n was written with this digest
+    int  finish();			// after af_close(); 0 if every window read back
+    uint64_t checked() const { return checked_total; }
+    uint64_t checked_while_imaging() const { return checked_early; }
+
+private:
+    readback_verifier(const readback_verifier &);		// not implemented
+    readback_verifier &operator=(const readback_verifier &);	// not implemented
+
+    enum result { MATCHES, NOT_YET, DIFFERS };
+    result check(AFFILE *af,uint64_t n,const sha256_t &digest,bool closed);
+    void run();				// the background thread
+
+    const char *image;
+    uint64_t window_size;
+    std::vector<unsigned char> buf;
+
+    std::mutex M;			// protects everything below
+    std::condition_variable work_ready;	// signaled when a window is added or we finish
+    std::map<uint64_t,sha256_t> todo;	// windows to check, by number
+    std::map<uint64_t,sha256_t> suspect; // didn't match while imaging; check again
+    std::vector<uint64_t> bad;		// didn't match after af_close()
+    bool     closed;			// af_close() has been called
+    uint64_t checked_total;
+    uint64_t checked_early;		// before af_close()
+    std::thread thread;
+};
+
+#endif
@@ -0,0 +1,322 @@
+/*
+ * window_hash.cpp:
+ * Per-window SHA256s of the image, and the tree over them.
+ */
+
+#include "config.h"
+#include "aimage.h"
+#include "window_hash.h"
+#include "verify.h"
+
+window_hash::window_hash(AFFILE *af_,uint64_t window_,bool tree_,int nthreads):
+    af(af_),window_size(window_),tree(tree_),rb(0),active(false),gen(0),cur_job(0),
+    cur(0),next(0),end(0),pending(),leaves(),hashed(0),have_root(false),root(),
+    max_pending(0),in_flight(0),M(),work_ready(),job_done(),queue(),done(),freelist(),
+    finished(false),threads()
+{
+    if(af_update_segq(af,AIMAGE_HASH_WINDOW,(int64)window_size)){
+	if(errno!=ENOTSUP) perror("Could not update " AIMAGE_HASH_WINDOW);
+    }
+    if(tree && !tree_wanted(af) && af_update_seg(af,AIMAGE_TREE_SHA256,0,0,0)){ // until finish() has the root
+	if(errno!=ENOTSUP) perror("Could not update " AIMAGE_TREE_SHA256);
+    }
+    max_pending = nthreads * 2;		// keeps every thread busy while we read
+    for(int i=0;i<nthreads;i++){
+	threads.push_back(std::thread(&window_hash::run,this));
+    }
+}
+
+window_hash::~window_hash()
+{
+    {
+	std::lock_guard<std::mutex> lock(M);
+	finished = true;
+	work_ready.notify_all();
+    }
+    for(size_t i=0;i<threads.size();i++){
+	threads[i].join();
+    }
+    delete gen;
+    delete cur_job;
+    for(size_t i=0;i<queue.size();i++) delete queue[i];
+    for(size_t i=0;i<done.size();i++) delete done[i];
+    for(size_t i=0;i<freelist.size();i++) delete freelist[i];
+}
+
+uint64_t window_hash::stored_window(AFFILE *af)
+{
+    int64 window = 0;
+    if(af_get_segq(af,AIMAGE_HASH_WINDOW,&window) || window<0) return 0;
+    return window;
+}
+
+bool window_hash::get(AFFILE *af,uint64_t n,sha256_t *digest)
+{
+    char name[AF_MAX_NAME_LEN];
+    snprintf(name,sizeof(name),AIMAGE_WINDOW_SHA256,(int64)n);
+    size_t len = digest->SIZE;
+    return af_get_seg(af,name,0,digest->digest,&len)==0 && len==digest->SIZE;
+}
+
+bool window_hash::tree_wanted(AFFILE *af)
+{
+    size_t len = 0;
+    return af_get_seg(af,AIMAGE_TREE_SHA256,0,0,&len)==0;
+}
+
+bool window_hash::get_root(AFFILE *af,sha256_t *digest)
+{
+    size_t len = digest->SIZE;
+    return af_get_seg(af,AIMAGE_TREE_SHA256,0,digest->digest,&len)==0 && len==digest->SIZE;
+}
+
+/* The root of the tree over leaves [begin,end) */
+static sha256_t tree_node(const std::vector<sha256_t> &leaves,size_t begin,size_t end)
+{
+    sha256_generator g;
+    if(end-begin==1){
+	static const uint8_t leaf_prefix = 0x00;
+	g.update(&leaf_prefix,1);
+	g.update(leaves[begin].digest,leaves[begin].SIZE);
+	return g.final();
+    }
+    size_t k = 1;
+    while(k*2 < end-begin) k *= 2;	// the largest power of two below the count
+    sha256_t left  = tree_node(leaves,begin,begin+k);
+    sha256_t right = tree_node(leaves,begin+k,end);
+    static const uint8_t node_prefix = 0x01;
+    g.update(&node_prefix,1);
+    g.update(left.digest,left.SIZE);
+    g.update(right.digest,right.SIZE);
+    return g.final();
+}
+
+sha256_t window_hash::root_of(const std::vector<sha256_t> &leaves)
+{
+    if(leaves.empty()) return sha256_generator::hash_buf(0,0);
+    return tree_node(leaves,0,leaves.size());
+}
+
+void window_hash::store(uint64_t n,const sha256_t &digest)
+{
+    char name[AF_MAX_NAME_LEN];
+    snprintf(name,sizeof(name),AIMAGE_WINDOW_SHA256,(int64)n);
+    if(af_update_seg(af,name,0,digest.final(),digest.SIZE)){
+	if(errno!=ENOTSUP) perror("Could not update window hash");
+    }
+    if(tree) leaves[n] = digest;
+    if(rb) rb->add(n,digest);
+    hashed++;
+}
+
+window_hash::job *window_hash::get_job()
+{
+    job *j = 0;
+    if(freelist.size()){
+	j = freelist.back();
+	freelist.pop_back();
+    }
+    else {
+	j = new job();
+    }
+    j->data.resize(window_size);
+    j->len = 0;
+    return j;
+}
+
+void window_hash::submit(job *j)
+{
+    std::unique_lock<std::mutex> lock(M);
+    while(in_flight>=max_pending) job_done.wait(lock);
+    queue.push_back(j);
+    in_flight++;
+    work_ready.notify_one();
+}
+
+void window_hash::collect(bool all)
+{
+    std::vector<job *> mine;
+    {
+	std::unique_lock<std::mutex> lock(M);
+	while(all && in_flight>0) job_done.wait(lock);
+	mine.swap(done);
+    }
+    for(size_t i=0;i<mine.size();i++){
+	store(mine[i]->n,mine[i]->digest);
+	freelist.push_back(mine[i]);
+    }
+}
+
+void window_hash::run()
+{
+    for(;;){
+	job *j = 0;
+	{
+	    std::unique_lock<std::mutex> lock(M);
+	    while(!finished && queue.empty()) work_ready.wait(lock);
+	    if(queue.empty()) return;
+	    j = queue.front();
+	    queue.pop_front();
+	}
+	j->digest = sha256_generator::hash_buf(j->data.data(),j->len);
+	std::lock_guard<std::mutex> lock(M);
+	done.push_back(j);
+	in_flight--;
+	job_done.notify_all();
+    }
+}
+
+void window_hash::begin(uint64_t n)
+{
+    abandon();
+    cur = n;
+    if(threads.empty()){
+	gen = new sha256_generator();
+    }
+    else {
+	cur_job = get_job();
+	cur_job->n = n;
+    }
+    active = true;
+}
+
+void window_hash::add(const unsigned char *buf,int len)
+{
+    if(gen){
+	gen->update(buf,len);
+    }
+    else {
+	memcpy(cur_job->data.data()+cur_job->len,buf,len);
+	cur_job->len += len;
+    }
+}
+
+void window_hash::complete()
+{
+    pending.erase(cur);
+    if(gen){
+	store(cur,gen->final());
+	delete gen;
+	gen = 0;
+    }
+    else {
+	submit(cur_job);
+	cur_job = 0;
+	collect(false);
+    }
+    active = false;
+}
+
+void window_hash::abandon()
+{
+    if(!active) return;
+    pending.insert(cur);
+    delete gen;
+    gen = 0;
+    if(cur_job) freelist.push_back(cur_job);
+    cur_job = 0;
+    active = false;
+}
+
+void window_hash::write(const unsigned char *buf,uint64_t offset,int len)
+{
+    if(offset+len > end) end = offset+len;
+    while(len>0){
+	uint64_t n     = offset / window_size;
+	uint64_t start = n * window_size;
+	int count = start+window_size-offset < (uint64_t)len ? (int)(start+window_size-offset) : len;
+
+	if(active && n==cur && offset==next){
+	    add(buf,count);		// carrying on
+	}
+	else if(offset==start){
+	    begin(n);			// starting a window afresh
+	    add(buf,count);
+	}
+	else {
+	    if(active && n==cur) abandon();
+	    pending.insert(n);		// picked up in the middle
+	}
+	next = offset+count;
+	if(active && n==cur && next==start+window_size){
+	    complete();
+	}
+	buf    += count;
+	offset += count;
+	len    -= count;
+    }
+}
+
+void window_hash::finish()
+{
+    af_cache_flush(af);			// so that af_read() sees all of it
+    uint64_t image_size = af_get_imagesize(af);
+    if(image_size<end) image_size = end;
+
+    /* The last window is short if it ended where the image does */
+    if(active && next==image_size){
+	complete();
+    }
+    abandon();
+    collect(true);
+
+    /* For the tree, every window needs a digest, even those that
+     * were not written this time (--append) or not at all.
+     */
+    uint64_t nwindows = (image_size + window_size - 1) / window_size;
+    if(tree){
+	for(uint64_t n=0;n<nwindows;n++){
+	    sha256_t digest;
+	    if(leaves.count(n) || pending.count(n)) continue;
+	    if(get(af,n,&digest)) leaves[n] = digest;
+	    else pending.insert(n);
+	}
+    }
+
+    /* Hash the rest from the image */
+    std::vector<unsigned char> buf(threads.empty() ? window_size : 0);
+    for(std::set<uint64_t>::const_iterator it=pending.begin();it!=pending.end();++it){
+	uint64_t start = *it * window_size;
+	if(start>=image_size) continue;
+	uint64_t len = image_size-start < window_size ? image_size-start : window_size;
+	job *j = threads.empty() ? 0 : get_job();
+	unsigned char *into = j ? j->data.data() : buf.data();
+	af_seek(af,start,SEEK_SET);
+	if(af_read(af,into,len)!=(int)len){
+	    warnx("cannot read window %" PRIu64 " back to hash it",*it);
+	    if(j) freelist.push_back(j);
+	    continue;
+	}
+	if(j){
+	    j->n   = *it;
+	    j->len = len;
+	    submit(j);
+	    collect(false);
+	}
+	else {
+	    store(*it,sha256_generator::hash_buf(into,len));
+	}
+    }
+    collect(true);
+    pending.clear();
+
+    if(tree) store_tree(nwindows);
+}
+
+void window_hash::store_tree(uint64_t nwindows)
+{
+    std::vector<sha256_t> digests;
+    for(uint64_t n=0;n<nwindows;n++){
+	std::map<uint64_t,sha256_t>::const_iterator it = leaves.find(n);
+	if(it==leaves.end()){
+	    warnx("no digest for window %" PRIu64 "; the tree hash is not stored",n);
+	    return;
+	}
+	digests.push_back(it->second);
+    }
+    root = root_of(digests);
+    have_root = true;
+    if(af_update_seg(af,AIMAGE_TREE_SHA256,0,root.final(),root.SIZE)){
+	if(errno!=ENOTSUP) perror("Could not update " AIMAGE_TREE_SHA256);
+    }
+}
@@ -0,0 +1,129 @@
+/*
+ * window_hash.h:
+ * SHA256s of each window of the image (--hash_window), so that a part
+ * of an image can be checked without hashing all of it, and a bad spot
+ * found to within a window.
+ *
+ * The windows are the same size all the way through, given by the
+ * AIMAGE_HASH_WINDOW segment, and the digest of window n is stored in
+ * segment AIMAGE_WINDOW_SHA256 with n in the name. The last window
+ * may be short.
+ *
+ * write() is given everything that is written to the image. A window
+ * that is written from start to finish in order is hashed as it goes
+ * by and stored as soon as it is complete. Any other window (one
+ * written out of order, or around an error, or that a resumed image
+ * picks up in the middle of) is hashed by finish() from what ended up
+ * in the image, so every window touched has a digest that matches
+ * the image. finish() must be called after everything is written out.
+ *
+ * Given nthreads, complete windows are copied and hashed on that many
+ * threads instead of as they go by; the digests are stored on the
+ * imaging thread, as afflib is not thread-safe.
+ *
+ * With --tree_hash, finish() also makes sure that every window of the
+ * image has a digest and stores the root of a Merkle tree over them in
+ * AIMAGE_TREE_SHA256. The tree is built the way RFC 6962 builds one:
+ * each leaf is SHA256(0x00 || window digest), each node above is
+ * SHA256(0x01 || left || right), and a tree of n leaves is split into
+ * the largest power of two below n on the left and the rest on the
+ * right. Unlike the MD5/SHA1/SHA256 of the image, the root does not
+ * depend on the order in which the windows were read, so it is valid
+ * after imaging in reverse or with -e2, and any window can be checked
+ * against it with the digests of its log2(n) neighbours. A new image
+ * has the segment left empty until the root is known, so that
+ * --append knows to finish it; an existing root stays until finish()
+ * replaces it.
+ *
+ * Given a readback_verifier, each digest is also handed to it as it is
+ * stored, so that the window can be read back from the image and
+ * checked while imaging goes on (--verify_readback).
+ */
+
+#ifndef WINDOW_HASH_H
+#define WINDOW_HASH_H
+
+#include "hash_t.h"
+
+#include <stdint.h>
+#include <set>
+#include <map>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <afflib/afflib.h>
+
+class window_hash {
+public:
+    window_hash(AFFILE *af,uint64_t window,bool tree=false,int nthreads=0);
+    ~window_hash();
+
+    void write(const unsigned char *buf,uint64_t offset,int len);
+    void finish();
+    void send_to(class readback_verifier *rb_) { rb = rb_; }
+    uint64_t window() const { return window_size; }
+    uint64_t windows_hashed() const { return hashed; }
+    bool tree_valid() const { return have_root; }
+    const sha256_t &tree_root() const { return root; }
+
+    static uint64_t stored_window(AFFILE *af); // from AIMAGE_HASH_WINDOW, or 0
+    static bool get(AFFILE *af,uint64_t n,sha256_t *digest); // false if there is none
+    static bool tree_wanted(AFFILE *af);	// was the image started with a tree?
+    static bool get_root(AFFILE *af,sha256_t *digest); // from AIMAGE_TREE_SHA256, once it is done
+    static sha256_t root_of(const std::vector<sha256_t> &leaves); // the tree over window digests
+
+private:
+    window_hash(const window_hash &);		// not implemented
+    window_hash &operator=(const window_hash &);	// not implemented
+
+    class job {				// one window, for a worker thread
+    public:
+	job():n(0),data(),len(0),digest(){}
+	uint64_t n;
+	std::vector<unsigned char> data;
+	size_t   len;
+	sha256_t digest;
+    };
+
+    void store(uint64_t n,const sha256_t &digest);
+    void begin(uint64_t n);		// start hashing window n as it goes by
+    void add(const unsigned char *buf,int len);
+    void complete();			// the current window is all there
+    void abandon();			// the current window won't be written in order
+    job *get_job();
+    void submit(job *j);		// hand a full window to the workers
+    void collect(bool all);		// store what they have done; all waits for every one
+    void run();				// worker thread
+    void store_tree(uint64_t nwindows);
+
+    AFFILE   *af;
+    uint64_t window_size;
+    bool     tree;			// make the tree at the end
+    class readback_verifier *rb;	// gets each digest stored, or 0
+    bool     active;			// window cur is being hashed as it goes by
+    sha256_generator *gen;		// for cur, without threads
+    job      *cur_job;			// for cur, with threads
+    uint64_t cur;
+    uint64_t next;			// where the next write should be to continue cur
+    uint64_t end;			// end of the furthest write
+    std::set<uint64_t> pending;		// windows for finish() to hash
+    std::map<uint64_t,sha256_t> leaves;	// digests stored this time, for the tree
+    uint64_t hashed;
+    bool     have_root;
+    sha256_t root;
+
+    size_t   max_pending;
+    size_t   in_flight;			// submitted and not yet collected
+    std::mutex M;
+    std::condition_variable work_ready;	// signaled when a job is queued or we finish
+    std::condition_variable job_done;	// signaled when a job is hashed
+    std::deque<job *> queue;		// waiting for a worker
+    std::vector<job *> done;		// hashed, waiting for collect()
+    std::vector<job *> freelist;
+    bool finished;
+    std::vector<std::thread> threads;
+};
+
+#endif
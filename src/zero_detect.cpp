@@ -0,0 +1,193 @@
+/*
+ * zero_detect.cpp:
+ * Zero detection kernels and the code that picks one.
+ */
+
+#include "config.h"
+#include "zero_detect.h"
+
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ZERO_DETECT_X86
+#include <immintrin.h>
+#endif
+
+/****************************************************************
+ *** Scalar
+ ****************************************************************/
+
+static inline bool zero_scalar(const unsigned char *p,size_t len)
+{
+    size_t i = 0;
+    for(;i+32<=len;i+=32){
+	uint64_t a,b,c,d;
+	memcpy(&a,p+i,8);
+	memcpy(&b,p+i+8,8);
+	memcpy(&c,p+i+16,8);
+	memcpy(&d,p+i+24,8);
+	if(a|b|c|d) return false;
+    }
+    for(;i<len;i++){
+	if(p[i]) return false;
+    }
+    return true;
+}
+
+/****************************************************************
+ *** SSE2 and AVX2
+ ****************************************************************/
+
+#ifdef ZERO_DETECT_X86
+__attribute__((target("sse2")))
+static inline bool zero_sse2(const unsigned char *p,size_t len)
+{
+    size_t i = 0;
+    for(;i+64<=len;i+=64){
+	__m128i v = _mm_or_si128(_mm_or_si128(_mm_loadu_si128((const __m128i *)(p+i)),
+					      _mm_loadu_si128((const __m128i *)(p+i+16))),
+				 _mm_or_si128(_mm_loadu_si128((const __m128i *)(p+i+32)),
+					      _mm_loadu_si128((const __m128i *)(p+i+48))));
+	if(_mm_movemask_epi8(_mm_cmpeq_epi8(v,_mm_setzero_si128()))!=0xffff) return false;
+    }
+    return zero_scalar(p+i,len-i);
+}
+
+__attribute__((target("avx2")))
+static inline bool zero_avx2(const unsigned char *p,size_t len)
+{
+    size_t i = 0;
+    for(;i+128<=len;i+=128){
+	__m256i v = _mm256_or_si256(_mm256_or_si256(_mm256_loadu_si256((const __m256i *)(p+i)),
+						     _mm256_loadu_si256((const __m256i *)(p+i+32))),
+				    _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(p+i+64)),
+						    _mm256_loadu_si256((const __m256i *)(p+i+96))));
+	if(!_mm256_testz_si256(v,v)) return false;
+    }
+    return zero_scalar(p+i,len-i);
+}
+#endif
+
+/****************************************************************
+ *** Sector counting, one version per kernel
+ ****************************************************************/
+
+/* The common sector sizes are template parameters, so that the
+ * kernel's loop is unrolled for them.
+ */
+template<size_t SS>
+static uint64_t count_scalar_fixed(const unsigned char *buf,size_t nsectors)
+{
+    uint64_t count = 0;
+    for(size_t i=0;i<nsectors;i++){
+	if(zero_scalar(buf+i*SS,SS)) count++;
+    }
+    return count;
+}
+
+static uint64_t count_scalar(const unsigned char *buf,size_t nsectors,size_t ss)
+{
+    if(ss==512)  return count_scalar_fixed<512>(buf,nsectors);
+    if(ss==4096) return count_scalar_fixed<4096>(buf,nsectors);
+    uint64_t count = 0;
+    for(size_t i=0;i<nsectors;i++){
+	if(zero_scalar(buf+i*ss,ss)) count++;
+    }
+    return count;
+}
+
+#ifdef ZERO_DETECT_X86
+template<size_t SS> __attribute__((target("sse2")))
+static uint64_t count_sse2_fixed(const unsigned char *buf,size_t nsectors)
+{
+    uint64_t count = 0;
+    for(size_t i=0;i<nsectors;i++){
+	if(zero_sse2(buf+i*SS,SS)) count++;
+    }
+    return count;
+}
+
+__attribute__((target("sse2")))
+static uint64_t count_sse2(const unsigned char *buf,size_t nsectors,size_t ss)
+{
+    if(ss==512)  return count_sse2_fixed<512>(buf,nsectors);
+    if(ss==4096) return count_sse2_fixed<4096>(buf,nsectors);
+    uint64_t count = 0;
+    for(size_t i=0;i<nsectors;i++){
+	if(zero_sse2(buf+i*ss,ss)) count++;
+    }
+    return count;
+}
+
+template<size_t SS> __attribute__((target("avx2")))
+static uint64_t count_avx2_fixed(const unsigned char *buf,size_t nsectors)
+{
+    uint64_t count = 0;
+    for(size_t i=0;i<nsectors;i++){
+	if(zero_avx2(buf+i*SS,SS)) count++;
+    }
+    return count;
+}
+
+__attribute__((target("avx2")))
+static uint64_t count_avx2(const unsigned char *buf,size_t nsectors,size_t ss)
+{
+    if(ss==512)  return count_avx2_fixed<512>(buf,nsectors);
+    if(ss==4096) return count_avx2_fixed<4096>(buf,nsectors);
+    uint64_t count = 0;
+    for(size_t i=0;i<nsectors;i++){
+	if(zero_avx2(buf+i*ss,ss)) count++;
+    }
+    return count;
+}
+#endif
+
+/****************************************************************
+ *** Dispatch
+ ****************************************************************/
+
+struct zero_kernel {
+    bool (*is_zero)(const unsigned char *,size_t);
+    uint64_t (*count)(const unsigned char *,size_t,size_t);
+};
+
+#ifdef ZERO_DETECT_X86
+__attribute__((target("sse2")))
+static bool is_zero_sse2(const unsigned char *p,size_t len) { return zero_sse2(p,len); }
+__attribute__((target("avx2")))
+static bool is_zero_avx2(const unsigned char *p,size_t len) { return zero_avx2(p,len); }
+#endif
+static bool is_zero_scalar(const unsigned char *p,size_t len) { return zero_scalar(p,len); }
+
+static zero_kernel pick_kernel()
+{
+#ifdef ZERO_DETECT_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")){
+	zero_kernel k = {is_zero_avx2,count_avx2};
+	return k;
+    }
+    if(__builtin_cpu_supports("sse2")){
+	zero_kernel k = {is_zero_sse2,count_sse2};
+	return k;
+    }
+#endif
+    zero_kernel k = {is_zero_scalar,count_scalar};
+    return k;
+}
+
+static const zero_kernel &kernel()
+{
+    static const zero_kernel k = pick_kernel();
+    return k;
+}
+
+bool buffer_is_zero(const unsigned char *buf,size_t len)
+{
+    return kernel().is_zero(buf,len);
+}
+
+uint64_t count_zero_sectors(const unsigned char *buf,size_t nsectors,size_t sector_size)
+{
+    return kernel().count(buf,nsectors,sector_size);
+}
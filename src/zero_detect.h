@@ -0,0 +1,21 @@
+/*
+ * zero_detect.h:
+ * Fast tests for all-zero data, used by write_data() to count blank
+ * sectors in everything we acquire.
+ *
+ * On x86 the work is done with AVX2 or SSE2, whichever the CPU
+ * supports (checked once, at the first call); elsewhere it is done a
+ * word at a time. 512 and 4096 byte sectors have their own unrolled
+ * versions; any other sector size works, just not as quickly.
+ */
+
+#ifndef ZERO_DETECT_H
+#define ZERO_DETECT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+bool buffer_is_zero(const unsigned char *buf,size_t len);
+uint64_t count_zero_sectors(const unsigned char *buf,size_t nsectors,size_t sector_size);
+
+#endif